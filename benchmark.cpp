@@ -0,0 +1,237 @@
+#include "utilities.cpp"
+#include <chrono>
+#include <random>
+
+// Runs f repeatedly for about a second and prints the throughput over
+// num_bytes of input per run.
+template <class F> void benchmark(const char *name, size_t num_bytes, F f) {
+  using clock = std::chrono::steady_clock;
+  f(); // warm up
+
+  unsigned int runs = 0;
+  auto start = clock::now();
+  std::chrono::duration<double> elapsed;
+  do {
+    f();
+    runs++;
+    elapsed = clock::now() - start;
+  } while (elapsed.count() < 1.0);
+
+  std::cout << name << ": " << (num_bytes * runs) / elapsed.count() / 1e9
+            << " GB/s" << std::endl;
+}
+
+// Duration of a single run of f, in seconds
+template <class F> double seconds(F f) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  f();
+  return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+std::vector<byte> random_bytes(size_t n) {
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<unsigned int> dist(0, 255);
+  std::vector<byte> v(n);
+  std::generate(v.begin(), v.end(), [&] { return dist(gen); });
+  return v;
+}
+
+int main() {
+  static constexpr size_t size = 1 << 24;
+  auto bytes = random_bytes(size);
+
+  std::string hex_s(2 * size, 0);
+  benchmark("hex encode scalar", size, [&] {
+    hex::encode_scalar(bytes.data(), size, &hex_s[0]);
+  });
+  benchmark("hex encode", size,
+            [&] { hex::encode(bytes.data(), size, &hex_s[0]); });
+
+  benchmark("hex decode scalar", hex_s.size(), [&] {
+    hex::decode_scalar(hex_s.data(), hex_s.size(), bytes.data());
+  });
+  benchmark("hex decode", hex_s.size(), [&] {
+    hex::decode(hex_s.data(), hex_s.size(), bytes.data());
+  });
+
+  std::string base64_s(base64::encoded_size(size), 0);
+  benchmark("base64 encode scalar", size, [&] {
+    base64::encode_scalar(bytes.data(), size, &base64_s[0]);
+  });
+  benchmark("base64 encode", size,
+            [&] { base64::encode(bytes.data(), size, &base64_s[0]); });
+
+  size_t written;
+  benchmark("base64 decode scalar", base64_s.size(), [&] {
+    base64::decode_scalar(base64_s.data(), base64_s.size(), bytes.data(),
+                          written);
+  });
+  benchmark("base64 decode", base64_s.size(), [&] {
+    base64::decode(base64_s.data(), base64_s.size(), bytes.data(), written);
+  });
+
+  std::string url_safe_s(base64_s.size(), 0);
+  base64::encode<base64::UrlSafe>(bytes.data(), size, &url_safe_s[0]);
+  benchmark("base64 url-safe decode", url_safe_s.size(), [&] {
+    base64::decode<base64::UrlSafe>(url_safe_s.data(), url_safe_s.size(),
+                                    bytes.data(), written);
+  });
+
+  // 76-character lines, as in MIME
+  std::string base64_lines;
+  for (size_t i = 0; i < base64_s.size(); i += 76) {
+    base64_lines.append(base64_s, i, 76);
+    base64_lines.push_back('\n');
+  }
+  std::vector<byte> decoded(
+      required_size(Encoding::base64, base64_lines.size()));
+  for (unsigned int num_threads = 1;; num_threads *= 2) {
+    num_threads = std::min(num_threads, default_num_threads());
+    auto name = "base64 parallel decode, " + std::to_string(num_threads) +
+                " threads";
+    benchmark(name.c_str(), base64_lines.size(), [&] {
+      size_t error_pos;
+      parallel_decode(base64_lines, decoded, Encoding::base64, num_threads,
+                      error_pos);
+    });
+    if (num_threads == default_num_threads()) {
+      break;
+    }
+  }
+
+  // Detection is meant to stay on for every line, so compare it with decoding.
+  // Single runs of both are timed in turns over the same lines, and the
+  // fastest of each is kept, so that noise and clock changes hit both alike.
+  std::vector<byte> line_bytes(76);
+  auto decode_lines = [&] {
+    for_each_line(base64_lines, [&](auto line) {
+      string_to_bytes(line, line_bytes, Encoding::base64);
+    });
+  };
+  auto decode_lines_detected = [&] {
+    for_each_line(base64_lines, [&](auto line) {
+      Encoding mode;
+      decode_detected(line, line_bytes, mode);
+    });
+  };
+  double plain = seconds(decode_lines);
+  double detected = seconds(decode_lines_detected);
+  for (unsigned int round = 1; round < 20; round++) {
+    plain = std::min(plain, seconds(decode_lines));
+    detected = std::min(detected, seconds(decode_lines_detected));
+  }
+  std::cout << "base64 line decode: " << base64_lines.size() / plain / 1e9
+            << " GB/s" << std::endl;
+  std::cout << "base64 line decode detected: "
+            << base64_lines.size() / detected / 1e9 << " GB/s ("
+            << 100 * (detected - plain) / plain << "% detection overhead)"
+            << std::endl;
+
+  // the prefix scan decode_detected adds to each line, on its own: the
+  // fastest scan of all lines less the fastest bare walk over them
+  volatile size_t num_lines = 0;
+  auto walk_lines = [&] {
+    for_each_line(base64_lines, [&](auto) { num_lines = num_lines + 1; });
+  };
+  volatile unsigned int guesses = 0;
+  auto scan_lines = [&] {
+    for_each_line(base64_lines, [&](auto line) {
+      size_t data_chars;
+      guesses = guesses | detect::scan(line.data(),
+                                       std::min<size_t>(line.size(), 32),
+                                       data_chars);
+      num_lines = num_lines + 1;
+    });
+  };
+  double walk = seconds(walk_lines);
+  double scan = seconds(scan_lines);
+  for (unsigned int round = 1; round < 20; round++) {
+    walk = std::min(walk, seconds(walk_lines));
+    scan = std::min(scan, seconds(scan_lines));
+  }
+  auto lines = (base64_s.size() + 75) / 76;
+  std::cout << "base64 line prefix scan: " << 1e9 * (scan - walk) / lines
+            << " ns per line, decode: " << 1e9 * plain / lines
+            << " ns per line" << std::endl;
+  benchmark("base64 detect", base64_s.size(),
+            [&] { detect_encoding(base64_s); });
+
+  // 16 KB operands stay in cache, as in crib dragging
+  auto lhs = random_bytes(1 << 14);
+  auto rhs = lhs;
+  std::reverse(rhs.begin(), rhs.end());
+  std::vector<byte> xored(lhs.size());
+  benchmark("xor scalar", lhs.size(), [&] {
+    bitwise::xor_scalar(xored.data(), lhs.data(), rhs.data(), lhs.size());
+  });
+  benchmark("xor", lhs.size(), [&] { xor_into(xored, lhs, rhs); });
+  benchmark("fixed_xor", lhs.size(), [&] { fixed_xor(lhs, rhs); });
+
+  // the key length of challenge 6
+  auto key = random_bytes(29);
+  benchmark("repeating key xor byte by byte", size, [&] {
+    for (size_t i = 0; i < size; i++) {
+      bytes[i] ^= key[i % key.size()];
+    }
+  });
+  KeyPattern pattern(key);
+  benchmark("repeating key xor", size,
+            [&] { pattern.apply(bytes, bytes); });
+  for (unsigned int num_threads = 1;; num_threads *= 2) {
+    num_threads = std::min(num_threads, default_num_threads());
+    auto name = "parallel repeating key xor, " + std::to_string(num_threads) +
+                " threads";
+    benchmark(name.c_str(), size, [&] {
+      pattern.parallel_apply(bytes, bytes, 0, num_threads);
+    });
+    if (num_threads == default_num_threads()) {
+      break;
+    }
+  }
+
+  // a ciphertext line of challenge 4 and a longer english text
+  auto line = string_to_bytes(
+      "7b5a4215415d544115415d5015455447414c155c46155f4058455c5b523f");
+  benchmark("single byte xor key search, 30 bytes", line.size(),
+            [&] { decrypt_single_byte_xor(line); });
+  std::string english;
+  while (english.size() < 4096) {
+    english += "Now that the party is jumping, with the bass kicked in. ";
+  }
+  auto english_xored =
+      single_byte_xor(string_to_bytes(english, Encoding::ascii), 'X');
+  benchmark("single byte xor key search, 4 KB", english_xored.size(),
+            [&] { decrypt_single_byte_xor(english_xored); });
+  benchmark("single byte xor key search, log-likelihood", line.size(), [&] {
+    decrypt_single_byte_xor<1, true, scorer::LogLikelihood>(line);
+  });
+  benchmark("single byte xor key search, full byte", line.size(), [&] {
+    decrypt_single_byte_xor<1, true, scorer::FullByte>(line);
+  });
+  benchmark("single byte xor key search, space aware", line.size(), [&] {
+    decrypt_single_byte_xor<1, true, scorer::SpaceAware>(line);
+  });
+  benchmark("single byte xor key search, all keys", line.size(),
+            [&] { decrypt_single_byte_xor<1, false>(line); });
+  benchmark("single byte xor key search, all keys fixed point", line.size(),
+            [&] {
+              decrypt_single_byte_xor<1, false, scorer::FixedChiSquared>(line);
+            });
+  benchmark("single byte xor key search, n-gram", line.size(), [&] {
+    decrypt_single_byte_xor<1, true, scorer::NGram<>>(line);
+  });
+  benchmark("single byte xor key search, n-gram 4 KB", english_xored.size(),
+            [&] {
+              decrypt_single_byte_xor<1, true, scorer::NGram<>>(english_xored);
+            });
+
+  {
+    std::ofstream file("benchmark.tmp", std::ios::binary);
+    file.write(reinterpret_cast<const char *>(bytes.data()), size);
+  }
+  benchmark("xor file", size,
+            [&] { xor_file("benchmark.tmp", "benchmark.tmp.xor", key); });
+  std::remove("benchmark.tmp");
+  std::remove("benchmark.tmp.xor");
+}
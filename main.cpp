@@ -1,6 +1,7 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 #include "utilities.cpp"
+#include <sstream>
 
 TEST_CASE("Challenge 1 extended.") {
   std::string ascii_s = "I'm killing your brain like a poisonous mushroom";
@@ -20,6 +21,747 @@ TEST_CASE("Challenge 1 extended.") {
   REQUIRE(bytes_to_string(hex_v, Encoding::base64) == base64_s);
 }
 
+TEST_CASE("Hex decoding.") {
+  REQUIRE(string_to_bytes("00ff7fA0") ==
+          std::vector<byte>({0x00, 0xff, 0x7f, 0xa0}));
+
+  size_t error_pos;
+  REQUIRE(string_to_bytes("0a1g22", Encoding::hex, error_pos) ==
+          std::vector<byte>({0x0a}));
+  REQUIRE(error_pos == 3);
+  REQUIRE(string_to_bytes("0a1", Encoding::hex, error_pos).size() == 1);
+  REQUIRE(error_pos == 2);
+  REQUIRE(string_to_bytes("", Encoding::hex, error_pos).empty());
+  REQUIRE(error_pos == 0);
+}
+
+// Kernels runnable on this cpu, scalar first
+template <class Kernel>
+std::vector<Kernel> supported_kernels(Kernel scalar, Kernel sse41, Kernel avx2,
+                                      Kernel avx512) {
+  std::vector<Kernel> kernels = {scalar};
+  if (simd::cpu_level() >= simd::Level::sse41) {
+    kernels.push_back(sse41);
+  }
+  if (simd::cpu_level() >= simd::Level::avx2) {
+    kernels.push_back(avx2);
+  }
+  if (simd::cpu_level() >= simd::Level::avx512) {
+    kernels.push_back(avx512);
+  }
+  return kernels;
+}
+
+std::vector<byte> test_bytes(size_t n) {
+  std::vector<byte> v(n);
+  for (size_t i = 0; i < n; i++) {
+    v[i] = static_cast<byte>(i * 167 + 13);
+  }
+  return v;
+}
+
+#ifdef CRYPTOPALS_X86
+TEST_CASE("Hex kernels.") {
+  auto encoders = supported_kernels(hex::encode_scalar, hex::encode_sse41,
+                                    hex::encode_avx2, hex::encode_avx512);
+  auto decoders = supported_kernels(hex::decode_scalar, hex::decode_sse41,
+                                    hex::decode_avx2, hex::decode_avx512);
+
+  for (size_t n : {0, 1, 15, 16, 17, 63, 64, 65, 200, 1000}) {
+    auto bytes = test_bytes(n);
+    std::string expected(2 * n, 0);
+    hex::encode_scalar(bytes.data(), n, &expected[0]);
+
+    for (auto encode : encoders) {
+      std::string s(2 * n, 0);
+      encode(bytes.data(), n, &s[0]);
+      REQUIRE(s == expected);
+    }
+
+    std::transform(expected.begin(), expected.begin() + n / 2,
+                   expected.begin(), ::toupper);
+    for (auto decode : decoders) {
+      std::vector<byte> v(n);
+      REQUIRE(decode(expected.data(), 2 * n, v.data()) == 2 * n);
+      REQUIRE(v == bytes);
+      if (n > 0) {
+        auto invalid = expected;
+        invalid[2 * n - 3 * n / 4 - 1] = 'g';
+        REQUIRE(decode(invalid.data(), 2 * n, v.data()) ==
+                2 * n - 3 * n / 4 - 1);
+      }
+    }
+  }
+
+  REQUIRE(bytes_to_string(std::vector<byte>({0x00, 0x0f, 0xf0})) == "000ff0");
+}
+#endif
+
+TEST_CASE("Base64 decoding.") {
+  REQUIRE(string_to_bytes("TWFu", Encoding::base64) ==
+          string_to_bytes("Man", Encoding::ascii));
+  REQUIRE(string_to_bytes("TWE=", Encoding::base64) ==
+          string_to_bytes("Ma", Encoding::ascii));
+  REQUIRE(string_to_bytes("TQ==", Encoding::base64) ==
+          string_to_bytes("M", Encoding::ascii));
+  REQUIRE(string_to_bytes("", Encoding::base64).empty());
+
+  size_t error_pos;
+  REQUIRE(string_to_bytes("TWFuTQ==TWFu", Encoding::base64, error_pos) ==
+          string_to_bytes("Man", Encoding::ascii));
+  REQUIRE(error_pos == 6);
+  REQUIRE(string_to_bytes("TWFuT===", Encoding::base64, error_pos).size() == 3);
+  REQUIRE(error_pos == 5);
+  REQUIRE(string_to_bytes("TWFuTQ=", Encoding::base64, error_pos).size() == 3);
+  REQUIRE(error_pos == 4);
+}
+
+TEST_CASE("Base64 encoding.") {
+  REQUIRE(bytes_to_string(string_to_bytes("Man", Encoding::ascii),
+                          Encoding::base64) == "TWFu");
+  REQUIRE(bytes_to_string(string_to_bytes("Ma", Encoding::ascii),
+                          Encoding::base64) == "TWE=");
+  REQUIRE(bytes_to_string(string_to_bytes("M", Encoding::ascii),
+                          Encoding::base64) == "TQ==");
+  REQUIRE(bytes_to_string({}, Encoding::base64).empty());
+
+  for (size_t n = 0; n < 100; n++) {
+    auto bytes = test_bytes(n);
+    auto s = bytes_to_string(bytes, Encoding::base64);
+    REQUIRE(s.size() == base64::encoded_size(n));
+    REQUIRE(string_to_bytes(s, Encoding::base64) == bytes);
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+TEST_CASE("Base64 kernels.") {
+  auto encoders =
+      supported_kernels(base64::encode_scalar<>, base64::encode_scalar<>,
+                        base64::encode_avx2<>, base64::encode_avx2<>);
+  for (size_t n : {0, 1, 31, 32, 33, 56, 100, 1000}) {
+    auto bytes = test_bytes(n);
+    std::string expected(base64::encoded_size(n), 0);
+    base64::encode_scalar(bytes.data(), n, &expected[0]);
+    for (auto encode : encoders) {
+      std::string s(base64::encoded_size(n), 0);
+      encode(bytes.data(), n, &s[0]);
+      REQUIRE(s == expected);
+    }
+  }
+
+  auto decoders =
+      supported_kernels(base64::decode_scalar<>, base64::decode_scalar<>,
+                        base64::decode_avx2<>, base64::decode_avx2<>);
+
+  for (size_t n : {0, 4, 60, 64, 68, 128, 400}) {
+    std::string s(n, 0);
+    for (size_t i = 0; i < n; i++) {
+      s[i] = base64::base64_alphabet[(i * 37 + 5) % 64];
+    }
+    if (n > 0) {
+      s[n - 1] = '=';
+    }
+    std::vector<byte> expected(n);
+    size_t expected_size;
+    REQUIRE(base64::decode_scalar(s.data(), n, expected.data(),
+                                  expected_size) == n);
+
+    for (auto decode : decoders) {
+      std::vector<byte> v(n);
+      size_t size;
+      REQUIRE(decode(s.data(), n, v.data(), size) == n);
+      REQUIRE(size == expected_size);
+      REQUIRE(v == expected);
+      if (n > 8) {
+        auto invalid = s;
+        invalid[n / 2 + 1] = '-';
+        REQUIRE(decode(invalid.data(), n, v.data(), size) == n / 2 + 1);
+      }
+    }
+  }
+}
+#endif
+
+// Not vectorizable: letters and digits come after the symbols
+struct CryptAlphabet {
+  static constexpr std::experimental::string_view alphabet{
+      "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz", 64};
+  static constexpr char padding = '\0';
+};
+
+// Vectorizable, with both symbols in rows of letters
+struct BracketAlphabet {
+  static constexpr std::experimental::string_view alphabet{
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789@[", 64};
+  static constexpr char padding = '=';
+};
+
+// Round trip through the dispatched kernels, and all kernels of the cpu when
+// the alphabet is vectorizable
+template <class Alphabet> void check_alphabet() {
+  for (size_t n : {0, 1, 2, 3, 4, 5, 47, 48, 49, 100, 1000}) {
+    auto bytes = test_bytes(n);
+    std::string s(base64::encoded_size<Alphabet>(n), 0);
+    base64::encode<Alphabet>(bytes.data(), n, &s[0]);
+    REQUIRE(std::all_of(s.begin(), s.end(),
+                        base64::is_valid_base64_char<Alphabet>));
+
+    std::vector<byte> v(n);
+    size_t written;
+    REQUIRE(base64::decode<Alphabet>(s.data(), s.size(), v.data(), written) ==
+            s.size());
+    REQUIRE(written == n);
+    REQUIRE(v == bytes);
+
+#ifdef CRYPTOPALS_X86
+    if constexpr (base64::is_vectorizable<Alphabet>()) {
+      for (auto encode : supported_kernels(
+               base64::encode_scalar<Alphabet>, base64::encode_scalar<Alphabet>,
+               base64::encode_avx2<Alphabet>, base64::encode_avx2<Alphabet>)) {
+        std::string t(s.size(), 0);
+        encode(bytes.data(), n, &t[0]);
+        REQUIRE(t == s);
+      }
+      for (auto decode : supported_kernels(
+               base64::decode_scalar<Alphabet>, base64::decode_scalar<Alphabet>,
+               base64::decode_avx2<Alphabet>, base64::decode_avx2<Alphabet>)) {
+        std::vector<byte> w(n);
+        REQUIRE(decode(s.data(), s.size(), w.data(), written) == s.size());
+        REQUIRE(w == bytes);
+        for (auto c : {'+', '-', '/', '_', '@', '[', '\x80'}) {
+          if (n >= 48 && !base64::is_valid_base64_char<Alphabet>(c)) {
+            auto invalid = s;
+            invalid[s.size() / 2] = c;
+            REQUIRE(decode(invalid.data(), s.size(), w.data(), written) ==
+                    s.size() / 2);
+          }
+        }
+      }
+    }
+#endif
+  }
+}
+
+TEST_CASE("Base64 alphabets.") {
+  using base64::Standard;
+  using base64::UrlSafe;
+  using base64::Unpadded;
+
+  const std::vector<byte> bytes = {0xfb, 0xff};
+  std::string s(4, 0);
+  base64::encode<Standard>(bytes.data(), 2, &s[0]);
+  REQUIRE(s == "+/8=");
+  base64::encode<UrlSafe>(bytes.data(), 2, &s[0]);
+  REQUIRE(s == "-_8=");
+  REQUIRE(base64::encoded_size<Unpadded<UrlSafe>>(2) == 3);
+  base64::encode<Unpadded<UrlSafe>>(bytes.data(), 2, &s[0]);
+  REQUIRE(s.substr(0, 3) == "-_8");
+
+  static_assert(base64::is_valid_base64_char<UrlSafe>('-'), "");
+  static_assert(!base64::is_valid_base64_char<UrlSafe>('+'), "");
+  static_assert(!base64::is_valid_base64_char<Unpadded<Standard>>('='), "");
+  static_assert(base64::base64_to_int<UrlSafe>('_') == 63, "");
+
+  std::vector<byte> v(3);
+  size_t written;
+  REQUIRE(base64::decode<UrlSafe>("+/8=", 4, v.data(), written) == 0);
+  REQUIRE(base64::decode<Unpadded<Standard>>("TWE=", 4, v.data(), written) ==
+          3);
+  REQUIRE(base64::decode<Unpadded<Standard>>("TWE", 3, v.data(), written) ==
+          3);
+  REQUIRE(written == 2);
+  REQUIRE(base64::decode<Unpadded<Standard>>("TWFuT", 5, v.data(), written) ==
+          4);
+  REQUIRE(base64::decode<Standard>("TWE", 3, v.data(), written) == 0);
+
+  check_alphabet<Standard>();
+  check_alphabet<UrlSafe>();
+  check_alphabet<Unpadded<UrlSafe>>();
+  check_alphabet<BracketAlphabet>();
+  check_alphabet<CryptAlphabet>();
+  static_assert(!base64::is_vectorizable<CryptAlphabet>(), "");
+}
+
+static constexpr char ice_hex[] = "494345";
+static constexpr char ma_base64[] = "TWE=";
+static constexpr char man_base64[] = "TWFu";
+
+#ifdef CRYPTOPALS_X86
+TEST_CASE("Whitespace kernels.") {
+  auto counters = supported_kernels(whitespace::count_scalar,
+                                    whitespace::count_scalar,
+                                    whitespace::count_avx2,
+                                    whitespace::count_avx2);
+  auto compactors = supported_kernels(whitespace::compact_scalar,
+                                      whitespace::compact_scalar,
+                                      whitespace::compact_avx2,
+                                      whitespace::compact_avx2);
+
+  // whitespace every 7, every other, pseudo-random and all characters
+  for (size_t pattern = 0; pattern < 4; pattern++) {
+    std::string s;
+    for (size_t i = 0; i < 200; i++) {
+      bool space = pattern == 0   ? i % 7 == 0
+                   : pattern == 1 ? i % 2 == 0
+                   : pattern == 2 ? (i * 37 + i / 5) % 3 == 0
+                                  : true;
+      s += space ? " \n\r\t"[i % 4] : 'a' + i % 26;
+    }
+    std::string expected;
+    std::copy_if(s.begin(), s.end(), std::back_inserter(expected),
+                 [](char c) { return !is_space(c); });
+
+    for (auto count : counters) {
+      REQUIRE(count(s.data(), s.size()) == expected.size());
+    }
+    for (auto compact : compactors) {
+      for (size_t capacity :
+           {size_t(0), std::min<size_t>(40, expected.size()),
+            expected.size()}) {
+        std::string out(capacity, 0);
+        size_t consumed;
+        REQUIRE(compact(s.data(), s.size(), &out[0], capacity, consumed) ==
+                capacity);
+        REQUIRE(out == expected.substr(0, capacity));
+        REQUIRE(consumed <= s.size());
+        REQUIRE(whitespace::count_scalar(s.data(), consumed) == capacity);
+      }
+    }
+  }
+}
+#endif
+
+TEST_CASE("Parallel decoding.") {
+  auto bytes = test_bytes(3 << 20);
+  // 60-character lines
+  std::string hex_s, base64_s;
+  auto hex_text = bytes_to_string(bytes, Encoding::hex);
+  auto base64_text = bytes_to_string(bytes, Encoding::base64);
+  for (size_t i = 0; i < hex_text.size(); i += 60) {
+    hex_s += hex_text.substr(i, 60) + "\r\n";
+  }
+  for (size_t i = 0; i < base64_text.size(); i += 60) {
+    base64_s += base64_text.substr(i, 60) + (i % 6000 == 0 ? " \t\n" : "\n");
+  }
+
+  for (unsigned int num_threads : {1, 2, 3, 4}) {
+    // compared outside REQUIRE, which would print the whole vectors
+    bool hex_equal =
+        parallel_decode(hex_s, Encoding::hex, num_threads) == bytes;
+    bool base64_equal =
+        parallel_decode(base64_s, Encoding::base64, num_threads) == bytes;
+    REQUIRE(hex_equal);
+    REQUIRE(base64_equal);
+
+    size_t error_pos;
+    auto invalid = base64_s;
+    invalid[invalid.size() / 2] = '!';
+    auto prefix = parallel_decode(invalid, Encoding::base64, num_threads,
+                                  error_pos);
+    REQUIRE(error_pos == invalid.size() / 2);
+    REQUIRE(std::equal(prefix.begin(), prefix.end(), bytes.begin()));
+
+    auto padded = "TQ==\n" + base64_s;
+    parallel_decode(padded, Encoding::base64, num_threads, error_pos);
+    REQUIRE(error_pos == 5);
+  }
+}
+
+TEST_CASE("Encoding detection.") {
+  for (unsigned int i = 0; i < 256; i++) {
+    auto c = static_cast<char>(i);
+    auto classes = detect::classes(c);
+    REQUIRE(((classes & (detect::digit | detect::hex_letter)) != 0) ==
+            (hex::hex_to_int(c) != hex::invalid_digit));
+    REQUIRE(((classes & (detect::base64_classes &
+                         ~detect::whitespace_classes)) != 0) ==
+            base64::is_valid_base64_char(c));
+    REQUIRE(((classes & detect::whitespace_classes) != 0) == is_space(c));
+  }
+
+#ifdef CRYPTOPALS_X86
+  auto scanners = supported_kernels(detect::scan_scalar, detect::scan_scalar,
+                                    detect::scan_avx2, detect::scan_avx2);
+  std::string hex_s = "0123456789abcdefABCDEF \n";
+  std::string base64_s = hex_s + "GHIJKLMNOPQRSTUVWXYZghijklmnopqrstuvwxyz+/=";
+  for (size_t n : {0, 1, 31, 32, 33, 100}) {
+    std::string s;
+    for (size_t i = 0; i < n; i++) {
+      s += hex_s[i * 7 % hex_s.size()];
+    }
+    auto spaces = std::count_if(s.begin(), s.end(), is_space);
+    for (auto scan : scanners) {
+      size_t data_chars;
+      REQUIRE(scan(s.data(), n, data_chars) ==
+              (detect::maybe_hex | detect::maybe_base64));
+      REQUIRE(data_chars == n - spaces);
+      if (n > 0) {
+        auto not_hex = s;
+        not_hex[n * 2 / 3] = base64_s[hex_s.size() + n % 40];
+        REQUIRE(scan(not_hex.data(), n, data_chars) == detect::maybe_base64);
+        REQUIRE(data_chars == n - spaces);
+        auto raw = s;
+        raw[n / 3] = '\x80';
+        REQUIRE(scan(raw.data(), n, data_chars) == 0);
+      }
+    }
+  }
+#endif
+
+  REQUIRE(detect_encoding("49276d206b696c6c") == Encoding::hex);
+  REQUIRE(detect_encoding("4927 6d20\r\n6b69") == Encoding::hex);
+  REQUIRE(detect_encoding("SSdtIGtp") == Encoding::base64);
+  REQUIRE(detect_encoding("TWE=\n") == Encoding::base64);
+  REQUIRE(detect_encoding("TQ==") == Encoding::base64);
+  REQUIRE(detect_encoding("TQ=A") == Encoding::ascii);
+  REQUIRE(detect_encoding("T===") == Encoding::ascii);
+  REQUIRE(detect_encoding("abc") == Encoding::ascii);
+  REQUIRE(detect_encoding("I'm killing your brain") == Encoding::ascii);
+  REQUIRE(detect_encoding("") == Encoding::ascii);
+  REQUIRE(detect_encoding("\n") == Encoding::ascii);
+  auto base64_line = std::string(34, 'A');
+  REQUIRE(detect_encoding(base64_line + "==") == Encoding::base64);
+  REQUIRE(detect_encoding(base64_line + "==\n\n") == Encoding::base64);
+  REQUIRE(detect_encoding(base64_line + "A=A=") == Encoding::ascii);
+  REQUIRE(detect_encoding(base64_line.substr(4) + "==AAAA") ==
+          Encoding::ascii);
+  REQUIRE(detect_encoding(base64_line.substr(3) + "=" + base64_line) ==
+          Encoding::ascii);
+
+  Encoding mode;
+  REQUIRE(bytes_to_string(decode_detected("49276d", mode), Encoding::ascii) ==
+          "I'm");
+  REQUIRE(mode == Encoding::hex);
+  REQUIRE(bytes_to_string(decode_detected("SSdt\nIGtp\nbGxp\nbmc=", mode),
+                          Encoding::ascii) == "I'm killing");
+  REQUIRE(mode == Encoding::base64);
+  REQUIRE(bytes_to_string(decode_detected("I'm", mode), Encoding::ascii) ==
+          "I'm");
+  REQUIRE(mode == Encoding::ascii);
+
+  // past the classified prefix
+  auto hex_line = std::string(40, 'a');
+  REQUIRE(decode_detected(hex_line, mode).size() == 20);
+  REQUIRE(mode == Encoding::hex);
+  REQUIRE(decode_detected(hex_line + "ghij", mode).size() == 33);
+  REQUIRE(mode == Encoding::base64);
+  REQUIRE(decode_detected(hex_line + "aa\naa", mode).size() == 22);
+  REQUIRE(mode == Encoding::hex);
+  REQUIRE(decode_detected(hex_line + "\x80", mode).size() == 41);
+  REQUIRE(mode == Encoding::ascii);
+}
+
+TEST_CASE("Compile-time literals.") {
+  constexpr auto ice = hex_literal<ice_hex>();
+  constexpr auto ma = b64_literal<ma_base64>();
+  constexpr auto man = b64_literal<man_base64>();
+  static_assert(ice.size() == 3 && ice[0] == 'I' && ice[2] == 'E', "");
+  static_assert(ma.size() == 2 && ma[1] == 'a', "");
+  static_assert(man.size() == 3 && man[2] == 'n', "");
+  static_assert(base64::base64_to_int('/') == 63, "");
+  static_assert(base64::base64_to_int('=') == 0, "");
+
+  REQUIRE(std::vector<byte>(ice.begin(), ice.end()) ==
+          string_to_bytes("ICE", Encoding::ascii));
+}
+
+TEST_CASE("Encoding into buffers.") {
+  std::vector<byte> buffer(required_size(Encoding::hex, 8));
+  REQUIRE(string_to_bytes("00ff7fa0", buffer) == 4);
+  REQUIRE(buffer == std::vector<byte>({0x00, 0xff, 0x7f, 0xa0}));
+  REQUIRE(string_to_bytes("beef", buffer) == 2);
+  REQUIRE(buffer[0] == 0xbe);
+  REQUIRE(buffer[1] == 0xef);
+
+  size_t error_pos;
+  REQUIRE(string_to_bytes("TQ==", buffer, Encoding::base64, error_pos) == 1);
+  REQUIRE(error_pos == 4);
+  REQUIRE(string_to_bytes("ab", buffer, Encoding::ascii) == 2);
+
+  std::string s(encoded_size(Encoding::base64, 4), 0);
+  REQUIRE(bytes_to_string(span<const byte>(buffer.data(), 1), s,
+                          Encoding::base64) == 4);
+  REQUIRE(s.substr(0, 4) == "YQ==");
+  REQUIRE(bytes_to_string(buffer, s, Encoding::hex) == 8);
+  REQUIRE(s == "61627fa0");
+}
+
+// Feeds s to a StreamDecoder in chunks of chunk_size characters
+template <class Alphabet>
+std::vector<byte> stream_decode(std::experimental::string_view s,
+                                size_t chunk_size,
+                                StreamDecoder<Alphabet> &decoder) {
+  std::vector<byte> bytes;
+  for (size_t i = 0; i < s.size(); i += chunk_size) {
+    auto chunk = s.substr(i, chunk_size);
+    std::vector<byte> out(decoder.required_size(chunk.size()));
+    out.resize(decoder.feed(chunk, out));
+    bytes.insert(bytes.end(), out.begin(), out.end());
+  }
+  std::vector<byte> out(decoder.required_size(0));
+  out.resize(decoder.finish(out));
+  bytes.insert(bytes.end(), out.begin(), out.end());
+  return bytes;
+}
+
+TEST_CASE("Encoded output streams.") {
+  auto bytes = test_bytes(10000);
+  std::ostringstream hex_stream, base64_stream, ascii_stream;
+  hex_stream << as_hex(bytes);
+  base64_stream << as_base64(bytes);
+  ascii_stream << bytes;
+  REQUIRE(hex_stream.str() == bytes_to_string(bytes, Encoding::hex));
+  REQUIRE(base64_stream.str() == bytes_to_string(bytes, Encoding::base64));
+  REQUIRE(ascii_stream.str() == bytes_to_string(bytes, Encoding::ascii));
+
+  std::ostringstream s;
+  s << as_base64(string_to_bytes("Ma", Encoding::ascii)) << " "
+    << as_hex(std::vector<byte>({0x0a}));
+  REQUIRE(s.str() == "TWE= 0a");
+}
+
+TEST_CASE("Stream decoding.") {
+  std::string base64_s = "SSdtIGtpbGxp bmcgeW91ciBi\ncmFpbiBsaWtl\r\nIGEgcG9p"
+                         "c29ub3VzIG11c2hyb29tIQ==\n";
+  std::string hex_s = "49276d206b696c\n6c696e672079\n6f757220627261696e21\n";
+  auto expected = string_to_bytes("I'm killing your brain like a poisonous "
+                                  "mushroom!",
+                                  Encoding::ascii);
+
+  for (size_t chunk_size : {1, 2, 3, 5, 7, 64}) {
+    StreamDecoder base64_decoder(Encoding::base64);
+    REQUIRE(stream_decode(base64_s, chunk_size, base64_decoder) == expected);
+    REQUIRE(!base64_decoder.failed());
+
+    StreamDecoder hex_decoder(Encoding::hex);
+    REQUIRE(bytes_to_string(stream_decode(hex_s, chunk_size, hex_decoder),
+                            Encoding::ascii) == "I'm killing your brain!");
+    REQUIRE(!hex_decoder.failed());
+
+    StreamDecoder padded_decoder(Encoding::base64);
+    stream_decode("TQ==\nTWFu", chunk_size, padded_decoder);
+    REQUIRE(padded_decoder.failed());
+    REQUIRE(padded_decoder.error_pos() == 5);
+
+    StreamDecoder invalid_decoder(Encoding::hex);
+    stream_decode("ab\nc d\nex", chunk_size, invalid_decoder);
+    REQUIRE(invalid_decoder.failed());
+    REQUIRE(invalid_decoder.error_pos() == 8);
+
+    StreamDecoder incomplete_decoder(Encoding::base64);
+    stream_decode("TWFu\nTW", chunk_size, incomplete_decoder);
+    REQUIRE(incomplete_decoder.failed());
+    REQUIRE(incomplete_decoder.error_pos() == 5);
+  }
+}
+
+TEST_CASE("Unpadded base64 decoding.") {
+  using Alphabet = base64::Unpadded<base64::UrlSafe>;
+  static_assert(base64::decoded_size<Alphabet>(5) == 3, "");
+  static_assert(base64::decoded_size<Alphabet>(6) == 4, "");
+  static_assert(base64::decoded_size<Alphabet>(7) == 5, "");
+  static_assert(base64::decoded_size<base64::Standard>(7) == 3, "");
+
+  // every length mod 4, decoded into buffers of exactly the required size
+  for (size_t n = 0; n < 100; n++) {
+    auto bytes = test_bytes(n);
+    auto s = bytes_to_string<Alphabet>(bytes, Encoding::base64);
+    REQUIRE(required_size<Alphabet>(Encoding::base64, s.size()) == n);
+
+    std::vector<byte> out(n);
+    size_t error_pos;
+    REQUIRE(string_to_bytes<Alphabet>(s, out, Encoding::base64, error_pos) ==
+            n);
+    REQUIRE(error_pos == s.size());
+    REQUIRE(out == bytes);
+
+    std::ostringstream stream;
+    stream << as_base64<Alphabet>(bytes);
+    REQUIRE(stream.str() == s);
+
+    StreamDecoder<Alphabet> decoder(Encoding::base64);
+    REQUIRE(stream_decode(s, 7, decoder) == bytes);
+    REQUIRE(!decoder.failed());
+    REQUIRE(parallel_decode<Alphabet>(s, Encoding::base64, 1) == bytes);
+  }
+}
+
+TEST_CASE("File decoding.") {
+  {
+    std::ofstream file("lines.txt", std::ios::binary);
+    file << "I'm back\nand I'm ringin'\r\n\nthe bell\n";
+  }
+  REQUIRE(bytes_to_string(file_to_bytes("lines.txt", Encoding::ascii),
+                          Encoding::ascii) ==
+          "I'm backand I'm ringin'\rthe bell");
+  std::remove("lines.txt");
+}
+
+TEST_CASE("Memory-mapped line scanning.") {
+  std::vector<std::string> lines;
+  auto collect = [&](auto line) { lines.push_back(std::string(line)); };
+
+  for_each_line("a\n\nbc\n", collect);
+  REQUIRE(lines == std::vector<std::string>({"a", "", "bc"}));
+  lines.clear();
+  for_each_line("a\nbc", collect);
+  REQUIRE(lines == std::vector<std::string>({"a", "bc"}));
+  lines.clear();
+  for_each_line("", collect);
+  REQUIRE(lines.empty());
+
+  MappedFile file("8.txt", true);
+  std::ifstream input("8.txt");
+  std::string expected((std::istreambuf_iterator<char>(input)),
+                       std::istreambuf_iterator<char>());
+  REQUIRE(file.text() == expected);
+  for_each_line(file.text(), collect);
+  REQUIRE(lines.size() == 204);
+
+  REQUIRE_THROWS(MappedFile("missing.txt"));
+}
+
+TEST_CASE("Line index.") {
+  LineIndex index("a\n\nbc\ndef");
+  REQUIRE(index.size() == 4);
+  REQUIRE(index[0] == "a");
+  REQUIRE(index[1] == "");
+  REQUIRE(index[3] == "def");
+  REQUIRE(index.offset(2) == 3);
+  REQUIRE(LineIndex("a\n").size() == 1);
+  REQUIRE(LineIndex("").size() == 0);
+
+  MappedFile file("4.txt");
+  std::remove("4.txt.idx");
+  auto built = load_line_index("4.txt", file.text());
+  auto loaded = load_line_index("4.txt", file.text());
+  REQUIRE(loaded.starts() == built.starts());
+
+  // a corrupt index is rebuilt, without trusting its number of starts
+  {
+    std::fstream index_file("4.txt.idx",
+                            std::ios::binary | std::ios::in | std::ios::out);
+    LineIndexHeader header;
+    index_file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    header.num_starts = uint64_t(1) << 60;
+    index_file.seekp(0);
+    index_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+  REQUIRE(load_line_index("4.txt", file.text(), false).starts() ==
+          built.starts());
+  REQUIRE(load_line_index("4.txt", file.text()).starts() == built.starts());
+  REQUIRE(load_line_index("4.txt", file.text()).starts() == built.starts());
+  REQUIRE(built.size() == 327);
+
+  std::vector<size_t> expected_starts = {0};
+  lines::find_starts_scalar(file.text().data(), file.size(), 0,
+                            expected_starts);
+  REQUIRE(expected_starts.size() == 327); // no '\n' after the last line
+#ifdef CRYPTOPALS_X86
+  for (auto find_starts : supported_kernels(
+           lines::find_starts_scalar, lines::find_starts_sse41,
+           lines::find_starts_avx2, lines::find_starts_avx512)) {
+    std::vector<size_t> starts = {0};
+    find_starts(file.text().data(), file.size(), 0, starts);
+    REQUIRE(starts == expected_starts);
+  }
+#endif
+
+  auto bounds = built.split(4);
+  REQUIRE(bounds.size() == 5);
+  REQUIRE(bounds.front() == 0);
+  REQUIRE(bounds.back() == built.size());
+  for (size_t k = 0; k < 4; k++) {
+    auto range_size = built.offset(bounds[k + 1]) - built.offset(bounds[k]);
+    REQUIRE(range_size <= file.size() / 4 + 61);
+  }
+}
+
+TEST_CASE("Record files.") {
+  std::remove("8.txt.bin");
+  auto expected = detect_aes_128_ecb<3>("8.txt");
+
+  write_record_file("8.txt");
+  REQUIRE(is_record_file("8.txt.bin"));
+  REQUIRE(!is_record_file("8.txt"));
+
+  MappedFile file("8.txt");
+  LineIndex index(file.text());
+  RecordFile records("8.txt.bin");
+  REQUIRE(records.matches(file.text(), Encoding::hex));
+  REQUIRE(!records.matches(file.text(), Encoding::base64));
+  REQUIRE(records.size() == index.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    auto bytes = string_to_bytes(index[i]);
+    REQUIRE(std::equal(bytes.begin(), bytes.end(), records[i].begin(),
+                       records[i].end()));
+  }
+
+  REQUIRE(detect_aes_128_ecb<3>("8.txt") == expected);
+  REQUIRE(detect_aes_128_ecb<3>("8.txt.bin") == expected);
+  REQUIRE_THROWS(RecordFile("8.txt"));
+  REQUIRE(!std::ifstream("8.txt.bin.tmp"));
+
+  // records past the end of the file are rejected at open
+  std::string contents(MappedFile("8.txt.bin").text());
+  auto write_corrupt = [](const std::string &text) {
+    std::ofstream corrupt("corrupt.bin", std::ios::binary);
+    corrupt << text;
+  };
+  write_corrupt(contents.substr(0, contents.size() - 1));
+  REQUIRE_THROWS(RecordFile("corrupt.bin"));
+  auto bad_offset = contents;
+  uint64_t offset = contents.size();
+  std::memcpy(&bad_offset[sizeof(RecordFileHeader)], &offset, sizeof(offset));
+  write_corrupt(bad_offset);
+  REQUIRE_THROWS(RecordFile("corrupt.bin"));
+  std::remove("corrupt.bin");
+
+  // a corrupt record file next to its text is ignored
+  std::ofstream("corrupt.txt", std::ios::binary) << file.text();
+  std::ofstream("corrupt.txt.bin", std::ios::binary) << bad_offset;
+  REQUIRE(detect_aes_128_ecb<3>("corrupt.txt") == expected);
+  std::remove("corrupt.txt");
+  std::remove("corrupt.txt.bin");
+}
+
+TEST_CASE("Xor kernels.") {
+#ifdef CRYPTOPALS_X86
+  auto kernels =
+      supported_kernels(bitwise::xor_scalar, bitwise::xor_sse41,
+                        bitwise::xor_avx2, bitwise::xor_avx512);
+#else
+  std::vector<decltype(&bitwise::xor_scalar)> kernels = {bitwise::xor_scalar};
+#endif
+  for (size_t n : {0, 1, 15, 16, 31, 32, 63, 64, 65, 200}) {
+    auto a = test_bytes(n);
+    std::vector<byte> b(n);
+    std::transform(a.begin(), a.end(), b.begin(),
+                   [](byte x) { return static_cast<byte>(x * 7 + 1); });
+    std::vector<byte> expected(n);
+    for (size_t i = 0; i < n; i++) {
+      expected[i] = a[i] ^ b[i];
+    }
+
+    for (auto xor_bytes : kernels) {
+      std::vector<byte> dst(n + 1, 0x5a); // guards the end
+      xor_bytes(dst.data(), a.data(), b.data(), n);
+      REQUIRE(std::vector<byte>(dst.begin(), dst.end() - 1) == expected);
+      REQUIRE(dst.back() == 0x5a);
+
+      auto inplace = a;
+      xor_bytes(inplace.data(), inplace.data(), b.data(), n);
+      REQUIRE(inplace == expected);
+    }
+
+    std::vector<byte> dst(n);
+    xor_into(dst, a, b);
+    REQUIRE(dst == expected);
+    xor_inplace(dst, b);
+    REQUIRE(dst == a);
+  }
+}
+
 TEST_CASE("Challenge 2.") {
   auto lhs = string_to_bytes("1c0111001f010100061a024b53535009181c");
   auto rhs = string_to_bytes("686974207468652062756c6c277320657965");
@@ -28,6 +770,349 @@ TEST_CASE("Challenge 2.") {
   REQUIRE(fixed_xor(lhs, rhs) == result);
 }
 
+TEST_CASE("Fused xor letter counts.") {
+  auto ciphertext = string_to_bytes(
+      "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
+  for (unsigned int key = 0; key < 256; key++) {
+    auto plaintext = single_byte_xor(ciphertext, static_cast<byte>(key));
+    LetterFrequencies lf;
+    bool printable =
+        count_letters_xored(ciphertext, static_cast<byte>(key), lf);
+    REQUIRE(printable == is_container_printable(plaintext));
+
+    LetterFrequencies expected = {};
+    for (auto b : plaintext) {
+      if (is_lower(b) || is_upper(b)) {
+        expected.freqs[(b | 0x20) - 'a']++;
+        expected.num_letters++;
+      }
+    }
+    count_letters_xored<false>(ciphertext, static_cast<byte>(key), lf);
+    REQUIRE(lf.freqs == expected.freqs);
+    REQUIRE(lf.num_letters == expected.num_letters);
+  }
+}
+
+TEST_CASE("Histogram key search.") {
+  auto ciphertext = string_to_bytes(
+      "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
+  XorHistogram histogram(ciphertext);
+  for (unsigned int key = 0; key < 256; key++) {
+    LetterFrequencies expected;
+    LetterFrequencies lf;
+    auto printable =
+        count_letters_xored(ciphertext, static_cast<byte>(key), expected);
+    REQUIRE(histogram.count_letters(static_cast<byte>(key), lf) == printable);
+    if (printable) {
+      REQUIRE(lf.freqs == expected.freqs);
+      REQUIRE(lf.num_letters == expected.num_letters);
+    }
+    histogram.count_letters<false>(static_cast<byte>(key), lf);
+    count_letters_xored<false>(ciphertext, static_cast<byte>(key), expected);
+    REQUIRE(lf.freqs == expected.freqs);
+  }
+
+  std::array<double, 5> per_key_chis;
+  std::array<double, 5> histogram_chis;
+  auto per_key_keys = decrypt_single_byte_xor<5, true, true, scorer::ChiSquared,
+                                              KeySearch::per_key>(
+      ciphertext, per_key_chis);
+  auto histogram_keys =
+      decrypt_single_byte_xor<5, true, true, scorer::ChiSquared,
+                              KeySearch::histogram>(ciphertext, histogram_chis);
+  REQUIRE(per_key_keys == histogram_keys);
+  REQUIRE(per_key_chis == histogram_chis);
+}
+
+TEST_CASE("Printable key pruning.") {
+  std::vector<std::vector<byte>> ciphertexts{
+      {},
+      string_to_bytes("1b37373331363f78151b7f2b783431333d78397828372d363c78"
+                      "373e783a393b3736"),
+      {0x00, 0x7f, 0x80, 0xff},
+      {0x20}};
+  for (const auto &ciphertext : ciphertexts) {
+    auto keys = printable_keys(ciphertext);
+    REQUIRE(XorHistogram(ciphertext).printable_keys().words == keys.words);
+    size_t num_keys = 0;
+    for (unsigned int key = 0; key < 256; key++) {
+      LetterFrequencies lf;
+      auto printable =
+          count_letters_xored(ciphertext, static_cast<byte>(key), lf);
+      REQUIRE(keys.contains(static_cast<byte>(key)) == printable);
+      num_keys += printable;
+    }
+    REQUIRE(keys.size() == num_keys);
+    std::vector<byte> listed;
+    keys.for_each([&](byte key) { listed.push_back(key); });
+    REQUIRE(listed.size() == num_keys);
+    REQUIRE(std::is_sorted(listed.begin(), listed.end()));
+  }
+}
+
+template <typename Scorer> void check_scorer() {
+  auto ciphertext = string_to_bytes(
+      "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
+  auto best_key = decrypt_single_byte_xor<1, true, Scorer>(ciphertext)[0];
+  REQUIRE(best_key == 'X');
+
+  std::array<double, 3> per_key_scores;
+  std::array<double, 3> histogram_scores;
+  auto per_key_keys =
+      decrypt_single_byte_xor<3, true, true, Scorer, KeySearch::per_key>(
+          ciphertext, per_key_scores);
+  auto histogram_keys =
+      decrypt_single_byte_xor<3, true, true, Scorer, KeySearch::histogram>(
+          ciphertext, histogram_scores);
+  REQUIRE(per_key_keys == histogram_keys);
+  for (size_t i = 0; i < per_key_scores.size(); i++) {
+    REQUIRE(per_key_scores[i] == Approx(histogram_scores[i]));
+  }
+
+  auto key = break_repeating_key_xor<40, true, 10, Scorer>("6.txt");
+  REQUIRE(bytes_to_string(key, Encoding::ascii) ==
+          "Terminator X: Bring the noise");
+}
+
+TEST_CASE("Fixed point chi squared.") {
+#ifdef CRYPTOPALS_X86
+  auto kernels = supported_kernels(fixed_chi::sums_scalar,
+                                   fixed_chi::sums_scalar,
+                                   fixed_chi::sums_avx2, fixed_chi::sums_avx2);
+#else
+  std::vector<decltype(&fixed_chi::sums_scalar)> kernels = {
+      fixed_chi::sums_scalar};
+#endif
+  std::string english;
+  while (english.size() < 100000) {
+    english += "Now that the party is jumping, with the bass kicked in. ";
+  }
+  for (size_t n : {0, 1, 30, 4096, 100000}) {
+    auto ciphertext = single_byte_xor(
+        string_to_bytes(english.substr(0, n), Encoding::ascii), 'X');
+    XorHistogram histogram(ciphertext);
+    auto counts =
+        fixed_chi::scaled_counts(histogram.counts(), histogram.size());
+
+    std::array<uint64_t, 256> expected_weighted;
+    std::array<uint32_t, 256> expected_letters;
+    fixed_chi::sums_scalar(counts.data(), expected_weighted.data(),
+                           expected_letters.data());
+    for (auto sums : kernels) {
+      std::array<uint64_t, 256> weighted;
+      std::array<uint32_t, 256> letters;
+      sums(counts.data(), weighted.data(), letters.data());
+      REQUIRE(weighted == expected_weighted);
+      REQUIRE(letters == expected_letters);
+    }
+
+    std::array<double, 256> scores;
+    scorer::FixedChiSquared::score_all(histogram, scores);
+    for (unsigned int key = 0; key < 256; key++) {
+      auto score =
+          scorer::FixedChiSquared::score(histogram, static_cast<byte>(key));
+      REQUIRE(scores[key] == score);
+      LetterFrequencies lf;
+      histogram.count_letters<false>(static_cast<byte>(key), lf);
+      if (lf.num_letters == 0) {
+        REQUIRE(scores[key] == std::numeric_limits<double>::max());
+      } else if (n <= fixed_chi::max_letters) {
+        auto chi = chi_squared_statistic(lf);
+        REQUIRE(scores[key] == Approx(chi).epsilon(1e-3));
+      }
+    }
+  }
+}
+
+TEST_CASE("Scorers.") {
+  check_scorer<scorer::ChiSquared>();
+  check_scorer<scorer::LogLikelihood>();
+  check_scorer<scorer::FullByte>();
+  check_scorer<scorer::SpaceAware>();
+  check_scorer<scorer::NGram<>>();
+  check_scorer<scorer::FixedChiSquared>();
+
+  // Only the scorers that look past letters tell a key from its case flip
+  auto ciphertext = string_to_bytes(
+      "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
+  auto log_likelihood_key =
+      decrypt_single_byte_xor<1, false, scorer::LogLikelihood>(ciphertext)[0];
+  auto full_byte_key =
+      decrypt_single_byte_xor<1, false, scorer::FullByte>(ciphertext)[0];
+  auto space_aware_key =
+      decrypt_single_byte_xor<1, false, scorer::SpaceAware>(ciphertext)[0];
+  REQUIRE(log_likelihood_key == 'X');
+  REQUIRE(full_byte_key == 'X');
+  REQUIRE(space_aware_key == 'X');
+
+  double sum = 0.0;
+  for (auto f : scorer::english_byte_freqs) {
+    REQUIRE(f > 0.0);
+    sum += f;
+  }
+  REQUIRE(sum == Approx(1.0));
+}
+
+TEST_CASE("N-gram scorer.") {
+  const auto &model = english_ngrams();
+  for (unsigned int a = 0; a < 256; a++) {
+    double row_sum = 0.0;
+    for (unsigned int b = 0; b < 256; b++) {
+      row_sum += std::exp(-double(model.bigram_cost(a, b)) / model.cost_scale);
+    }
+    REQUIRE(row_sum == Approx(1.0).epsilon(0.1));
+  }
+
+  // every kept trigram is found, and others fall back to their bigram
+  size_t num_slots = size_t(1) << model.trigram_bits;
+  size_t num_trigrams = 0;
+  for (size_t i = 0; i < num_slots; i++) {
+    auto slot = model.trigram_slots[i];
+    if (slot != model.empty_trigram_slot()) {
+      num_trigrams++;
+      REQUIRE(model.trigram_cost(slot >> 8) == (slot & 0xff));
+    }
+  }
+  REQUIRE(num_trigrams == std::end(english_trigrams) - english_trigrams);
+  REQUIRE(model.trigram_cost('x' << 16 | 'y' << 8 | 'z') ==
+          model.bigram_cost('y', 'z'));
+  REQUIRE(model.trigram_cost(0xffffff) == model.bigram_cost(0xff, 0xff));
+
+  // empty slots miss like any other, and a trigram kept twice never hashes
+  // apart, even in the largest table
+  std::array<double, 256> unigrams;
+  unigrams.fill(1.0 / 256);
+  std::vector<double> bigrams(256 * 256, 1.0 / 256);
+  std::vector<std::pair<uint32_t, double>> once = {{0x616263, 0.5}};
+  NGramTables tables(4.0, unigrams, bigrams, once);
+  REQUIRE(tables.model().trigram_cost(0x616263) == 3);
+  REQUIRE(tables.model().trigram_cost(0xffffff) ==
+          tables.model().bigram_cost(0xff, 0xff));
+  auto twice = once;
+  twice.push_back(once[0]);
+  REQUIRE_THROWS(NGramTables(4.0, unigrams, bigrams, twice));
+
+  // the letter counts of a key and of its case flip are the same, not their
+  // n-grams
+  auto ciphertext =
+      single_byte_xor(string_to_bytes("attack at dawn", Encoding::ascii), 'A');
+  auto chi_key = decrypt_single_byte_xor<1, true>(ciphertext)[0];
+  auto ngram_key =
+      decrypt_single_byte_xor<1, true, scorer::NGram<>>(ciphertext)[0];
+  REQUIRE(chi_key != 'A');
+  REQUIRE(ngram_key == 'A');
+}
+
+const NGramModel &lyrics_ngrams() {
+  static const MappedNGramModel lyrics("lyrics.model");
+  return lyrics.model();
+}
+
+TEST_CASE("Model files.") {
+  auto lyrics = repeating_key_xor(
+      file_to_bytes("6.txt", Encoding::base64),
+      string_to_bytes("Terminator X: Bring the noise", Encoding::ascii));
+  auto counts = count_ngrams(lyrics);
+  REQUIRE(counts.size == lyrics.size());
+  REQUIRE(std::accumulate(counts.unigrams.begin(), counts.unigrams.end(),
+                          uint64_t(0)) == lyrics.size());
+  REQUIRE(std::accumulate(counts.bigrams.begin(), counts.bigrams.end(),
+                          uint64_t(0)) == lyrics.size() - 1);
+  uint64_t num_trigrams = 0;
+  for (const auto &trigram : counts.trigrams) {
+    num_trigrams += trigram.second;
+  }
+  REQUIRE(num_trigrams == lyrics.size() - 2);
+
+  // slices of several threads count the n-grams across their boundaries
+  std::vector<byte> large;
+  while (large.size() < (3 << 20)) {
+    large.insert(large.end(), lyrics.begin(), lyrics.end());
+  }
+  auto single = count_ngrams(large, 1);
+  auto parallel = count_ngrams(large, 3);
+  REQUIRE(parallel.size == single.size);
+  REQUIRE(parallel.unigrams == single.unigrams);
+  REQUIRE(parallel.bigrams == single.bigrams);
+  REQUIRE(parallel.trigrams == single.trigrams);
+
+  auto tables = train_ngrams(counts);
+  const auto &trained = tables.model();
+  size_t num_kept = 0;
+  for (size_t i = 0; i < (size_t(1) << trained.trigram_bits); i++) {
+    auto slot = trained.trigram_slots[i];
+    if (slot != trained.empty_trigram_slot()) {
+      num_kept++;
+      REQUIRE(trained.trigram_cost(slot >> 8) == (slot & 0xff));
+    }
+  }
+  REQUIRE(num_kept == std::min<size_t>(4096, counts.trigrams.size()));
+
+  write_ngram_model("lyrics.model", trained, counts.size);
+  {
+    MappedNGramModel mapped("lyrics.model");
+    const auto &model = mapped.model();
+    REQUIRE(mapped.header().corpus_size == lyrics.size());
+    REQUIRE(model.cost_scale == trained.cost_scale);
+    REQUIRE(std::equal(model.unigram_costs, model.unigram_costs + 256,
+                       trained.unigram_costs));
+    REQUIRE(std::equal(model.bigram_costs, model.bigram_costs + 256 * 256,
+                       trained.bigram_costs));
+    REQUIRE(std::equal(model.trigram_slots,
+                       model.trigram_slots + (1 << model.trigram_bits),
+                       trained.trigram_slots));
+    REQUIRE(std::equal(model.trigram_displacements,
+                       model.trigram_displacements + (1 << model.bucket_bits),
+                       trained.trigram_displacements));
+  }
+
+  auto ciphertext = string_to_bytes(
+      "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
+  auto key =
+      decrypt_single_byte_xor<1, true, scorer::NGram<lyrics_ngrams>>(
+          ciphertext)[0];
+  REQUIRE(key == 'X');
+  auto lyrics_key =
+      break_repeating_key_xor<40, true, 10, scorer::NGram<lyrics_ngrams>>(
+          "6.txt");
+  REQUIRE(bytes_to_string(lyrics_key, Encoding::ascii) ==
+          "Terminator X: Bring the noise");
+
+  {
+    std::ofstream truncated("truncated.model", std::ios::binary);
+    truncated.write(ngram_file_magic.data(), ngram_file_magic.size());
+  }
+  REQUIRE_THROWS(MappedNGramModel("truncated.model"));
+  std::remove("truncated.model");
+
+  // a cost scale scores can't divide by, or a displacement out of the table
+  MappedFile lyrics_file("lyrics.model");
+  NGramFileHeader header;
+  std::memcpy(&header, lyrics_file.text().data(), sizeof(header));
+  REQUIRE(header.trigram_bits < 16);
+  auto sizes = ngram_table_sizes(header);
+  auto displacements_offset = sizeof(header) + sizes[0] + sizes[1] + sizes[2];
+  auto write_corrupt = [&](double cost_scale, uint16_t displacement) {
+    std::string text(lyrics_file.text());
+    auto corrupt_header = header;
+    corrupt_header.cost_scale = cost_scale;
+    std::memcpy(&text[0], &corrupt_header, sizeof(corrupt_header));
+    std::memcpy(&text[displacements_offset], &displacement,
+                sizeof(displacement));
+    std::ofstream("corrupt.model", std::ios::binary) << text;
+  };
+  write_corrupt(header.cost_scale, 0);
+  REQUIRE_NOTHROW(MappedNGramModel("corrupt.model"));
+  for (auto cost_scale : {0.0, -1.0, std::nan("")}) {
+    write_corrupt(cost_scale, 0);
+    REQUIRE_THROWS(MappedNGramModel("corrupt.model"));
+  }
+  write_corrupt(header.cost_scale, uint16_t(1u << header.trigram_bits));
+  REQUIRE_THROWS(MappedNGramModel("corrupt.model"));
+  std::remove("corrupt.model");
+  std::remove("lyrics.model");
+}
+
 TEST_CASE("Challenge 3.") {
   auto ciphertext = string_to_bytes(
       "1b37373331363f78151b7f2b783431333d78397828372d363c78373e783a393b3736");
@@ -45,19 +1130,16 @@ TEST_CASE("Challenge 4.") {
   auto best_lines = detect_single_byte_xor<2>("4.txt");
   bool line_found = false;
 
-  std::ifstream input("4.txt");
-  std::string cipherline;
-  for (unsigned int i = 0; std::getline(input, cipherline); i++) {
-    if (std::find(best_lines.begin(), best_lines.end(), i) !=
-        best_lines.end()) {
-      auto bytes = string_to_bytes(cipherline);
-      auto decrypted_key = decrypt_single_byte_xor(bytes)[0];
-      auto new_plainline = bytes_to_string(
-          single_byte_xor(bytes, decrypted_key), Encoding::ascii);
-      if (plainline == new_plainline) {
-        line_found = true;
-        break;
-      }
+  MappedFile file("4.txt");
+  auto index = load_line_index("4.txt", file.text());
+  for (auto i : best_lines) {
+    auto bytes = string_to_bytes(index[i]);
+    auto decrypted_key = decrypt_single_byte_xor(bytes)[0];
+    auto new_plainline =
+        bytes_to_string(single_byte_xor(bytes, decrypted_key), Encoding::ascii);
+    if (plainline == new_plainline) {
+      line_found = true;
+      break;
     }
   }
 
@@ -78,6 +1160,110 @@ TEST_CASE("Challenge 5.") {
   REQUIRE(repeating_key_xor(plaintext, key) == ciphertext);
 }
 
+TEST_CASE("Repeating key xor.") {
+  auto plaintext = test_bytes(10000);
+  for (size_t key_size : {1, 3, 64, 100, 5000, 20000}) {
+    auto key = test_bytes(key_size + 1);
+    key.erase(key.begin()); // not aligned with the plaintext bytes
+    std::vector<byte> expected(plaintext.size());
+    for (size_t i = 0; i < plaintext.size(); i++) {
+      expected[i] = plaintext[i] ^ key[i % key_size];
+    }
+    bool whole_equal = repeating_key_xor(plaintext, key) == expected;
+    REQUIRE(whole_equal);
+
+    // chunk by chunk with key offsets, in place
+    KeyPattern pattern(key);
+    auto chunked = plaintext;
+    for (size_t i = 0; i < chunked.size(); i += 777) {
+      auto n = std::min<size_t>(777, chunked.size() - i);
+      span<byte> chunk(chunked.data() + i, n);
+      pattern.apply(chunk, chunk, i);
+    }
+    bool chunked_equal = chunked == expected;
+    REQUIRE(chunked_equal);
+  }
+
+  // the parallel path matches the serial one, from any key offset
+  auto large = test_bytes((3 << 20) + 12345);
+  auto key = test_bytes(29);
+  KeyPattern pattern(key);
+  for (size_t offset : {0, 5, 1000}) {
+    std::vector<byte> serial(large.size());
+    pattern.apply(serial, large, offset);
+    for (unsigned int num_threads : {1, 2, 3, 8}) {
+      std::vector<byte> parallel(large.size());
+      parallel_repeating_key_xor(parallel, large, key, offset, num_threads);
+      bool parallel_equal = parallel == serial;
+      REQUIRE(parallel_equal);
+    }
+
+    // dst off cache line boundaries
+    std::vector<byte> buffer(large.size() + 7);
+    span<byte> misaligned(buffer.data() + 7, large.size());
+    parallel_repeating_key_xor(misaligned, large, key, offset, 3);
+    bool misaligned_equal =
+        std::equal(serial.begin(), serial.end(), buffer.begin() + 7);
+    REQUIRE(misaligned_equal);
+  }
+
+  // shorter than the key
+  key = string_to_bytes("ICEICE", Encoding::ascii);
+  auto short_plaintext = string_to_bytes("abc", Encoding::ascii);
+  REQUIRE(bytes_to_string(repeating_key_xor(short_plaintext, key)) ==
+          "282126");
+  std::vector<byte> out(2);
+  short_plaintext.pop_back();
+  repeating_key_xor(out, short_plaintext, key, 4);
+  REQUIRE(bytes_to_string(out) == "2227");
+}
+
+TEST_CASE("Streaming xor.") {
+  auto key = string_to_bytes("ICE", Encoding::ascii);
+  MappedFile file("6.txt");
+  auto plaintext = string_to_bytes(file.text(), Encoding::ascii);
+  auto expected = repeating_key_xor(plaintext, key);
+
+  XorStream stream(key);
+  std::vector<byte> chunked(plaintext.size());
+  for (size_t i = 0; i < plaintext.size(); i += 100) {
+    auto n = std::min<size_t>(100, plaintext.size() - i);
+    stream.feed({plaintext.data() + i, n}, {chunked.data() + i, n});
+  }
+  REQUIRE(stream.position() == plaintext.size());
+  REQUIRE(chunked == expected);
+
+  std::istringstream in(std::string(file.text()));
+  std::ostringstream out;
+  REQUIRE(xor_stream(in, out, key) == plaintext.size());
+  REQUIRE(string_to_bytes(out.str(), Encoding::ascii) == expected);
+
+  xor_file("6.txt", "6.txt.xor", key);
+  MappedFile xored("6.txt.xor");
+  REQUIRE(string_to_bytes(xored.text(), Encoding::ascii) == expected);
+
+  auto in_fd = ::open("6.txt.xor", O_RDONLY);
+  auto out_fd = ::open("6.txt.plain", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  REQUIRE(xor_stream(in_fd, out_fd, key) == plaintext.size());
+  ::close(in_fd);
+  ::close(out_fd);
+  MappedFile decrypted("6.txt.plain");
+  REQUIRE(decrypted.text() == file.text());
+
+  // in place, the output replaces the input once xored, keeping its mode
+  ::chmod("6.txt.plain", 0600);
+  xor_file("6.txt.plain", "6.txt.plain", key);
+  MappedFile in_place("6.txt.plain");
+  REQUIRE(string_to_bytes(in_place.text(), Encoding::ascii) == expected);
+  REQUIRE(!std::ifstream("6.txt.plain.tmp"));
+  struct stat st;
+  REQUIRE(::stat("6.txt.plain", &st) == 0);
+  REQUIRE((st.st_mode & 07777) == 0600);
+
+  std::remove("6.txt.xor");
+  std::remove("6.txt.plain");
+}
+
 TEST_CASE("Challenge 6.") {
   auto s1 = string_to_bytes("this is a test", Encoding::ascii);
   auto s2 = string_to_bytes("wokka wokka!!!", Encoding::ascii);
@@ -98,25 +1284,11 @@ TEST_CASE("Challenge 7.") {
 }
 
 TEST_CASE("Challenge 8.") {
-  // std::string plainline = "Now that the party is jumping\n";
   auto best_lines = detect_aes_128_ecb<1>("8.txt");
   std::string aes_line_start = "d880619740a8a19b";
-  bool line_found = false;
 
-  std::ifstream input("8.txt");
-  std::string cipherline;
-  for (unsigned int i = 0; std::getline(input, cipherline); i++) {
-    if (std::find(best_lines.begin(), best_lines.end(), i) !=
-        best_lines.end()) {
-
-      cipherline.resize(aes_line_start.size());
-
-      if (cipherline == aes_line_start) {
-        line_found = true;
-        break;
-      }
-    }
-  }
-
-  REQUIRE(line_found == true);
+  MappedFile file("8.txt");
+  auto index = load_line_index("8.txt", file.text());
+  REQUIRE(index[best_lines[0]].substr(0, aes_line_start.size()) ==
+          aes_line_start);
 }
@@ -0,0 +1,24 @@
+#include "utilities.cpp"
+
+// Decodes each line of a text corpus into <file>.bin, which the detectors
+// then read instead of the text as long as the corpus is unchanged.
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <file> [hex|base64]" << std::endl;
+    return 1;
+  }
+
+  std::experimental::string_view mode_name = argc == 3 ? argv[2] : "hex";
+  if (mode_name != "hex" && mode_name != "base64") {
+    std::cerr << "unknown encoding: " << mode_name << std::endl;
+    return 1;
+  }
+  auto mode = mode_name == "hex" ? Encoding::hex : Encoding::base64;
+
+  try {
+    write_record_file(argv[1], mode);
+  } catch (const std::exception &e) {
+    std::cerr << argv[1] << ": " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,31 @@
+#include "utilities.cpp"
+
+// Counts the byte n-grams of a plaintext corpus and writes the model trained
+// on them to a model file, for the n-gram scorer to map.
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " <model> <corpus>..." << std::endl;
+    return 1;
+  }
+
+  NGramCounts counts;
+  for (int i = 2; i < argc; i++) {
+    try {
+      MappedFile file(argv[i]);
+      auto text = file.text();
+      counts.merge(count_ngrams(
+          {reinterpret_cast<const byte *>(text.data()), text.size()}));
+    } catch (const std::exception &e) {
+      std::cerr << argv[i] << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  try {
+    auto tables = train_ngrams(counts);
+    write_ngram_model(argv[1], tables.model(), counts.size);
+  } catch (const std::exception &e) {
+    std::cerr << argv[1] << ": " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -1,16 +1,36 @@
 #include <algorithm>
 #include <array>
 #include <bitset>
+#include <cerrno>
+#include <cmath>
 #include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <experimental/string_view>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <numeric>
-#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRYPTOPALS_X86
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
 // uncomment to disable assert()
 // #define NDEBUG
 #include "evp-encrypt.cxx"
@@ -20,274 +40,3659 @@ using byte = uint8_t;
 static_assert(sizeof(byte) == 1);
 static_assert(CHAR_BIT == 8);
 
+// Non-owning view of n contiguous elements
+template <class T> class span {
+public:
+  constexpr span() = default;
+  constexpr span(T *data, size_t size) : data_(data), size_(size) {}
+  template <class Container>
+  constexpr span(Container &&c) : data_(c.data()), size_(c.size()) {}
+
+  constexpr T *data() const { return data_; }
+  constexpr size_t size() const { return size_; }
+  constexpr bool empty() const { return size_ == 0; }
+  constexpr T *begin() const { return data_; }
+  constexpr T *end() const { return data_ + size_; }
+  constexpr T &operator[](size_t i) const { return data_[i]; }
+  constexpr span subspan(size_t offset, size_t count) const {
+    return span(data_ + offset, count);
+  }
+
+private:
+  T *data_ = nullptr;
+  size_t size_ = 0;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Character encoding
 ///////////////////////////////////////////////////////////////////////////////
 
-constexpr bool is_upper(byte b) { return 'A' <= b && b <= 'Z'; }
-constexpr bool is_lower(byte b) { return 'a' <= b && b <= 'z'; }
-constexpr bool is_digit(byte b) { return '0' <= b && b <= '9'; }
-constexpr bool is_printable(byte b) {
-  return (' ' <= b && b <= '~') || b == '\n';
+constexpr bool is_upper(byte b) { return 'A' <= b && b <= 'Z'; }
+constexpr bool is_lower(byte b) { return 'a' <= b && b <= 'z'; }
+constexpr bool is_digit(byte b) { return '0' <= b && b <= '9'; }
+constexpr bool is_space(byte b) {
+  return b == ' ' || b == '\n' || b == '\r' || b == '\t';
+}
+constexpr bool is_printable(byte b) {
+  return (' ' <= b && b <= '~') || b == '\n';
+}
+
+template <class Container> bool is_container_printable(const Container &c) {
+  return std::find_if_not(std::begin(c), std::end(c), is_printable) ==
+         std::end(c);
+}
+
+namespace base64 {
+// Alphabet policies give the 64 characters in value order and the padding
+// character, or '\0' for an unpadded encoding. Each policy gets its own
+// tables and kernels at compile time.
+struct Standard {
+  static constexpr std::experimental::string_view alphabet{
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", 64};
+  static constexpr char padding = '=';
+};
+
+// RFC 4648 section 5, safe in URLs and filenames
+struct UrlSafe {
+  static constexpr std::experimental::string_view alphabet{
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_", 64};
+  static constexpr char padding = '=';
+};
+
+template <class Alphabet> struct Unpadded : Alphabet {
+  static constexpr char padding = '\0';
+};
+
+static constexpr auto base64_alphabet = Standard::alphabet;
+
+static constexpr byte invalid_char = 0xff;
+static constexpr char padding_char = Standard::padding;
+
+template <class Alphabet = Standard>
+constexpr std::array<byte, 256> make_base64_table() {
+  std::array<byte, 256> table{};
+  for (auto &value : table) {
+    value = invalid_char;
+  }
+  for (size_t i = 0; i < Alphabet::alphabet.size(); i++) {
+    table[static_cast<byte>(Alphabet::alphabet[i])] = static_cast<byte>(i);
+  }
+  return table;
+}
+
+template <class Alphabet>
+static constexpr auto table = make_base64_table<Alphabet>();
+
+static constexpr auto base64_table = table<Standard>;
+
+template <class Alphabet = Standard> constexpr bool is_padded() {
+  return Alphabet::padding != '\0';
+}
+
+template <class Alphabet = Standard>
+constexpr bool is_valid_base64_char(char c) {
+  return table<Alphabet>[static_cast<byte>(c)] != invalid_char ||
+         (is_padded<Alphabet>() && c == Alphabet::padding);
+}
+
+// Value of c, with padding worth 0
+template <class Alphabet = Standard>
+constexpr unsigned int base64_to_int(char c) {
+  assert(is_valid_base64_char<Alphabet>(c));
+
+  if (is_padded<Alphabet>() && c == Alphabet::padding) {
+    return 0;
+  }
+  return table<Alphabet>[static_cast<byte>(c)];
+}
+
+template <class Alphabet = Standard>
+constexpr char int_to_base64(unsigned int i) {
+  assert(0 <= i && i < 64);
+
+  return Alphabet::alphabet[i];
+}
+}
+
+namespace hex {
+static constexpr std::experimental::string_view hex_alphabet("0123456789abcdef",
+                                                            16);
+static constexpr byte invalid_digit = 0xff;
+
+constexpr byte hex_to_int(char c) {
+  if (is_digit(c)) {
+    return c - '0';
+  } else if ('a' <= c && c <= 'f') {
+    return 10 + (c - 'a');
+  } else if ('A' <= c && c <= 'F') {
+    return 10 + (c - 'A');
+  } else {
+    return invalid_digit;
+  }
+}
+
+constexpr std::array<byte, 256> make_hex_table() {
+  std::array<byte, 256> table{};
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i] = hex_to_int(static_cast<char>(i));
+  }
+  return table;
+}
+
+static constexpr auto hex_table = make_hex_table();
+}
+
+enum class Encoding { hex, ascii, base64 };
+
+///////////////////////////////////////////////////////////////////////////////
+// SIMD dispatch
+///////////////////////////////////////////////////////////////////////////////
+
+namespace simd {
+enum class Level { scalar, sse41, avx2, avx512 };
+
+inline Level detect_level() {
+#ifdef CRYPTOPALS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return Level::avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    return Level::avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    return Level::sse41;
+  }
+#endif
+  return Level::scalar;
+}
+
+// Widest instruction set of the running cpu, detected on first use
+inline Level cpu_level() {
+  static const Level level = detect_level();
+  return level;
+}
+
+template <class Kernel>
+Kernel pick(Kernel scalar, Kernel sse41, Kernel avx2, Kernel avx512) {
+  switch (cpu_level()) {
+  case Level::avx512:
+    return avx512;
+  case Level::avx2:
+    return avx2;
+  case Level::sse41:
+    return sse41;
+  case Level::scalar:
+    return scalar;
+  }
+  return scalar;
+}
+
+#ifdef CRYPTOPALS_X86
+TARGET_SSE41 inline __m128i load128(const void *p) {
+  return _mm_loadu_si128(static_cast<const __m128i *>(p));
+}
+TARGET_SSE41 inline void store128(void *p, __m128i v) {
+  _mm_storeu_si128(static_cast<__m128i *>(p), v);
+}
+TARGET_AVX2 inline __m256i load256(const void *p) {
+  return _mm256_loadu_si256(static_cast<const __m256i *>(p));
+}
+TARGET_AVX2 inline void store256(void *p, __m256i v) {
+  _mm256_storeu_si256(static_cast<__m256i *>(p), v);
+}
+TARGET_AVX512 inline __m512i load512(const void *p) {
+  return _mm512_loadu_si512(p);
+}
+TARGET_AVX512 inline void store512(void *p, __m512i v) {
+  _mm512_storeu_si512(p, v);
+}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Threads
+///////////////////////////////////////////////////////////////////////////////
+
+// Runs f(0), ..., f(num_threads - 1) concurrently, f(0) on the calling thread
+template <class Function>
+void run_parallel(unsigned int num_threads, Function f) {
+  std::vector<std::thread> threads;
+  for (unsigned int k = 1; k < num_threads; k++) {
+    threads.emplace_back(f, k);
+  }
+  f(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+unsigned int default_num_threads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hex kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// The decoders decode the n hex digits of in into n / 2 bytes of out. They
+// return the position of the first invalid digit (an unpaired last digit
+// counts as invalid), or n if the whole input was decoded.
+// The encoders encode the n bytes of in into 2 * n lowercase hex digits of out.
+
+namespace hex {
+constexpr size_t decode_scalar(const char *in, size_t n, byte *out) {
+  for (size_t i = 0; i + 1 < n; i += 2) {
+    auto hi = hex_table[static_cast<byte>(in[i])];
+    auto lo = hex_table[static_cast<byte>(in[i + 1])];
+    if ((hi | lo) == invalid_digit) {
+      return hi == invalid_digit ? i : i + 1;
+    }
+    *out++ = static_cast<byte>((hi << 4) | lo);
+  }
+  return n % 2 == 0 ? n : n - 1;
+}
+
+void encode_scalar(const byte *in, size_t n, char *out) {
+  for (size_t i = 0; i < n; i++) {
+    *out++ = hex_alphabet[in[i] >> 4];
+    *out++ = hex_alphabet[in[i] & 0x0f];
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+// Digit values are computed branch-free as c - '0' or (c | 0x20) - 'a' + 10,
+// and each pair of values is packed into a byte with a 16 * hi + lo
+// multiply-add. A block with an invalid digit is left to the scalar decoder,
+// which locates the error.
+
+TARGET_SSE41 inline __m128i digit_values(__m128i c, __m128i &valid) {
+  auto digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  auto alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                            _mm_set1_epi8('a'));
+  auto is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  auto is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+  valid = _mm_and_si128(valid, _mm_or_si128(is_digit, is_alpha));
+  return _mm_blendv_epi8(_mm_add_epi8(alpha, _mm_set1_epi8(10)), digit,
+                         is_digit);
+}
+
+TARGET_SSE41 size_t decode_sse41(const char *in, size_t n, byte *out) {
+  static constexpr size_t step = 32;
+  const auto weights = _mm_set1_epi16(0x0110);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    auto valid = _mm_set1_epi8(-1);
+    auto lo = digit_values(simd::load128(in + i), valid);
+    auto hi = digit_values(simd::load128(in + i + 16), valid);
+    if (_mm_movemask_epi8(valid) != 0xffff) {
+      break;
+    }
+    simd::store128(out + i / 2,
+                   _mm_packus_epi16(_mm_maddubs_epi16(lo, weights),
+                                    _mm_maddubs_epi16(hi, weights)));
+  }
+  return i + decode_scalar(in + i, n - i, out + i / 2);
+}
+
+TARGET_AVX2 inline __m256i digit_values(__m256i c, __m256i &valid) {
+  auto digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  auto alpha = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+                               _mm256_set1_epi8('a'));
+  auto is_digit =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  auto is_alpha =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+  valid = _mm256_and_si256(valid, _mm256_or_si256(is_digit, is_alpha));
+  return _mm256_blendv_epi8(_mm256_add_epi8(alpha, _mm256_set1_epi8(10)),
+                            digit, is_digit);
+}
+
+TARGET_AVX2 size_t decode_avx2(const char *in, size_t n, byte *out) {
+  static constexpr size_t step = 64;
+  const auto weights = _mm256_set1_epi16(0x0110);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    auto valid = _mm256_set1_epi8(-1);
+    auto lo = digit_values(simd::load256(in + i), valid);
+    auto hi = digit_values(simd::load256(in + i + 32), valid);
+    if (_mm256_movemask_epi8(valid) != -1) {
+      break;
+    }
+    // packus works per 128-bit lane: reorder qwords lo0 hi0 lo1 hi1
+    auto packed = _mm256_packus_epi16(_mm256_maddubs_epi16(lo, weights),
+                                      _mm256_maddubs_epi16(hi, weights));
+    simd::store256(out + i / 2, _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  return i + decode_scalar(in + i, n - i, out + i / 2);
+}
+
+TARGET_AVX512 inline __m512i digit_values(__m512i c, __mmask64 &valid) {
+  auto digit = _mm512_sub_epi8(c, _mm512_set1_epi8('0'));
+  auto alpha = _mm512_sub_epi8(_mm512_or_si512(c, _mm512_set1_epi8(0x20)),
+                               _mm512_set1_epi8('a'));
+  auto is_digit = _mm512_cmple_epu8_mask(digit, _mm512_set1_epi8(9));
+  auto is_alpha = _mm512_cmple_epu8_mask(alpha, _mm512_set1_epi8(5));
+  valid &= is_digit | is_alpha;
+  return _mm512_mask_blend_epi8(
+      is_digit, _mm512_add_epi8(alpha, _mm512_set1_epi8(10)), digit);
+}
+
+TARGET_AVX512 size_t decode_avx512(const char *in, size_t n, byte *out) {
+  static constexpr size_t step = 128;
+  const auto weights = _mm512_set1_epi16(0x0110);
+  const auto lane_order = _mm512_set_epi64(7, 5, 3, 1, 6, 4, 2, 0);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    __mmask64 valid = ~__mmask64(0);
+    auto lo = digit_values(simd::load512(in + i), valid);
+    auto hi = digit_values(simd::load512(in + i + 64), valid);
+    if (valid != ~__mmask64(0)) {
+      break;
+    }
+    auto packed = _mm512_packus_epi16(_mm512_maddubs_epi16(lo, weights),
+                                      _mm512_maddubs_epi16(hi, weights));
+    simd::store512(out + i / 2, _mm512_permutexvar_epi64(lane_order, packed));
+  }
+  return i + decode_scalar(in + i, n - i, out + i / 2);
+}
+
+// Nibbles are mapped to digits with a byte shuffle over the alphabet, then
+// high and low digits are interleaved.
+
+TARGET_SSE41 void encode_sse41(const byte *in, size_t n, char *out) {
+  static constexpr size_t step = 16;
+  const auto alphabet = simd::load128(hex_alphabet.data());
+  const auto nibble = _mm_set1_epi8(0x0f);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    auto x = simd::load128(in + i);
+    auto hi = _mm_shuffle_epi8(alphabet,
+                               _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+    auto lo = _mm_shuffle_epi8(alphabet, _mm_and_si128(x, nibble));
+    simd::store128(out + 2 * i, _mm_unpacklo_epi8(hi, lo));
+    simd::store128(out + 2 * i + 16, _mm_unpackhi_epi8(hi, lo));
+  }
+  encode_scalar(in + i, n - i, out + 2 * i);
+}
+
+TARGET_AVX2 void encode_avx2(const byte *in, size_t n, char *out) {
+  static constexpr size_t step = 32;
+  const auto alphabet =
+      _mm256_broadcastsi128_si256(simd::load128(hex_alphabet.data()));
+  const auto nibble = _mm256_set1_epi8(0x0f);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    auto x = simd::load256(in + i);
+    auto hi = _mm256_shuffle_epi8(
+        alphabet, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+    auto lo = _mm256_shuffle_epi8(alphabet, _mm256_and_si256(x, nibble));
+    // unpack works per 128-bit lane: a holds bytes 0-7 16-23, b 8-15 24-31
+    auto a = _mm256_unpacklo_epi8(hi, lo);
+    auto b = _mm256_unpackhi_epi8(hi, lo);
+    simd::store256(out + 2 * i, _mm256_permute2x128_si256(a, b, 0x20));
+    simd::store256(out + 2 * i + 32, _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  encode_scalar(in + i, n - i, out + 2 * i);
+}
+
+TARGET_AVX512 void encode_avx512(const byte *in, size_t n, char *out) {
+  static constexpr size_t step = 64;
+  const auto alphabet =
+      _mm512_broadcast_i32x4(simd::load128(hex_alphabet.data()));
+  const auto nibble = _mm512_set1_epi8(0x0f);
+  const auto first_half = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+  const auto second_half = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+
+  size_t i = 0;
+  for (; i + step <= n; i += step) {
+    auto x = simd::load512(in + i);
+    auto hi = _mm512_shuffle_epi8(
+        alphabet, _mm512_and_si512(_mm512_srli_epi16(x, 4), nibble));
+    auto lo = _mm512_shuffle_epi8(alphabet, _mm512_and_si512(x, nibble));
+    auto a = _mm512_unpacklo_epi8(hi, lo);
+    auto b = _mm512_unpackhi_epi8(hi, lo);
+    simd::store512(out + 2 * i, _mm512_permutex2var_epi64(a, first_half, b));
+    simd::store512(out + 2 * i + 64,
+                   _mm512_permutex2var_epi64(a, second_half, b));
+  }
+  encode_scalar(in + i, n - i, out + 2 * i);
+}
+#endif
+
+size_t decode(const char *in, size_t n, byte *out) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(decode_scalar, decode_sse41, decode_avx2, decode_avx512);
+  return kernel(in, n, out);
+#else
+  return decode_scalar(in, n, out);
+#endif
+}
+
+void encode(const byte *in, size_t n, char *out) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(encode_scalar, encode_sse41, encode_avx2, encode_avx512);
+  kernel(in, n, out);
+#else
+  encode_scalar(in, n, out);
+#endif
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Base64 kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// The decoders decode the n characters of in, in the given alphabet, into
+// decoded_size(n) bytes of out. With a padded alphabet, n is a multiple of 4
+// with optional padding in the last quantum; otherwise the last quantum may
+// have 2 or 3 characters.
+// They set written to the number of decoded bytes and return the position of
+// the first invalid character (the start of an incomplete last quantum counts
+// as invalid), or n if the whole input was decoded.
+
+namespace base64 {
+// Bytes decoded from n characters, at most; an unpadded last quantum of 2 or 3
+// characters holds 1 or 2 bytes
+template <class Alphabet = Standard> constexpr size_t decoded_size(size_t n) {
+  auto rest = n % 4;
+  return n / 4 * 3 + (!is_padded<Alphabet>() && rest >= 2 ? rest - 1 : 0);
+}
+
+// Whether the alphabet starts with A-Z, a-z and 0-9 like the standard one,
+// as the vector kernels assume. The last two characters may be any ascii
+// symbols, unless both share the high nibble of a letter or digit.
+template <class Alphabet> constexpr bool is_vectorizable() {
+  for (size_t i = 0; i < 62; i++) {
+    if (Alphabet::alphabet[i] != Standard::alphabet[i]) {
+      return false;
+    }
+  }
+  auto c62 = static_cast<byte>(Alphabet::alphabet[62]);
+  auto c63 = static_cast<byte>(Alphabet::alphabet[63]);
+  auto is_alnum_row = [](byte row) { return 3 <= row && row <= 7; };
+  return c62 < 0x80 && c63 < 0x80 &&
+         !((c62 >> 4) == (c63 >> 4) && is_alnum_row(c62 >> 4));
+}
+
+// Position of the first invalid character of a quantum, or 4 if none
+template <class Alphabet = Standard>
+constexpr size_t find_invalid(const char *quantum) {
+  size_t i = 0;
+  while (i < 4 &&
+         table<Alphabet>[static_cast<byte>(quantum[i])] != invalid_char) {
+    i++;
+  }
+  return i;
+}
+
+template <class Alphabet = Standard>
+constexpr size_t decode_scalar(const char *in, size_t n, byte *out,
+                               size_t &written) {
+  constexpr const auto &values = table<Alphabet>;
+  written = 0;
+  size_t i = 0;
+  for (; i + 4 < n; i += 4) { // all quanta but the last, no padding allowed
+    auto a = values[static_cast<byte>(in[i])];
+    auto b = values[static_cast<byte>(in[i + 1])];
+    auto c = values[static_cast<byte>(in[i + 2])];
+    auto d = values[static_cast<byte>(in[i + 3])];
+    if ((a | b | c | d) & 0x80) {
+      return i + find_invalid<Alphabet>(in + i);
+    }
+    out[written++] = static_cast<byte>((a << 2) | (b >> 4));
+    out[written++] = static_cast<byte>((b << 4) | (c >> 2));
+    out[written++] = static_cast<byte>((c << 6) | d);
+  }
+
+  auto rest = n - i;
+  if (rest == 0) {
+    return n;
+  }
+  if (rest < (is_padded<Alphabet>() ? 4 : 2)) {
+    return i;
+  }
+
+  // last quantum: "xxxx", "xxx=" or "xx==", or "xxx" or "xx" when unpadded
+  char quantum[4] = {};
+  for (size_t j = 0; j < rest; j++) {
+    quantum[j] = in[i + j];
+  }
+  auto padding = static_cast<unsigned int>(4 - rest);
+  if (is_padded<Alphabet>() && quantum[3] == Alphabet::padding) {
+    padding = quantum[2] == Alphabet::padding ? 2 : 1;
+  }
+  for (auto j = 4 - padding; j < 4; j++) {
+    quantum[j] = Alphabet::alphabet[0];
+  }
+  auto invalid = find_invalid<Alphabet>(quantum);
+  if (invalid < 4) {
+    return i + invalid;
+  }
+
+  unsigned int triple = 0;
+  for (auto c : quantum) {
+    triple = (triple << 6) | values[static_cast<byte>(c)];
+  }
+  for (unsigned int j = 0; j < 3 - padding; j++) {
+    out[written++] = static_cast<byte>(triple >> (16 - 8 * j));
+  }
+  return n;
+}
+
+#ifdef CRYPTOPALS_X86
+// Lookup tables of the vector decoder, indexed by nibble
+struct DecodeLuts {
+  // a character is invalid when its nibbles' entries share a bit
+  std::array<byte, 16> lo{};
+  std::array<byte, 16> hi{};
+  // offsets from characters to values, by high nibble
+  std::array<byte, 16> roll{};
+  // symbols whose high nibble already has an offset, looked up 8 rows below
+  std::array<char, 2> escaped{};
+  size_t num_escaped = 0;
+};
+
+template <class Alphabet> constexpr DecodeLuts make_decode_luts() {
+  DecodeLuts luts;
+  std::array<unsigned int, 16> valid_lo{}; // valid low nibbles of each row
+  std::array<bool, 16> has_offset{};
+  for (size_t i = 0; i < Alphabet::alphabet.size(); i++) {
+    auto c = static_cast<byte>(Alphabet::alphabet[i]);
+    auto row = c >> 4;
+    valid_lo[row] |= 1u << (c & 0x0f);
+
+    // letters and digits share the offset of their row
+    auto offset = static_cast<byte>(i - c);
+    if (i < 62 || !has_offset[row]) {
+      luts.roll[row] = offset;
+      has_offset[row] = true;
+    } else {
+      luts.roll[row + 8] = offset;
+      luts.escaped[luts.num_escaped++] = static_cast<char>(c);
+    }
+  }
+
+  // one bit per distinct set of valid low nibbles, at most 6 of them
+  std::array<unsigned int, 8> sets{};
+  size_t num_sets = 0;
+  for (size_t row = 0; row < 16; row++) {
+    size_t k = 0;
+    while (k < num_sets && sets[k] != valid_lo[row]) {
+      k++;
+    }
+    if (k == num_sets) {
+      sets[num_sets++] = valid_lo[row];
+    }
+    luts.hi[row] = static_cast<byte>(1 << k);
+  }
+  for (size_t lo = 0; lo < 16; lo++) {
+    for (size_t k = 0; k < num_sets; k++) {
+      if ((sets[k] >> lo & 1) == 0) {
+        luts.lo[lo] |= static_cast<byte>(1 << k);
+      }
+    }
+  }
+  return luts;
+}
+
+template <class Alphabet>
+static constexpr auto decode_luts = make_decode_luts<Alphabet>();
+
+// Vectorized lookup from Mula and Lemire, "Faster Base64 Encoding and
+// Decoding Using AVX2 Instructions": the character classes of the high and
+// low nibbles are intersected to validate, and a per-class offset maps each
+// character to its value. The tables are derived from the alphabet at
+// compile time. Each 32 characters are then packed into 24 bytes.
+template <class Alphabet = Standard>
+TARGET_AVX2 size_t decode_avx2(const char *in, size_t n, byte *out,
+                               size_t &written) {
+  static_assert(is_vectorizable<Alphabet>(), "alphabet not vectorizable");
+  constexpr const auto &luts = decode_luts<Alphabet>;
+  const auto lut_lo = _mm256_broadcastsi128_si256(simd::load128(&luts.lo));
+  const auto lut_hi = _mm256_broadcastsi128_si256(simd::load128(&luts.hi));
+  const auto lut_roll =
+      _mm256_broadcastsi128_si256(simd::load128(&luts.roll));
+  const auto nibble = _mm256_set1_epi8(0x0f);
+  const auto pack_shuffle = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+      4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const auto pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+  size_t i = 0;
+  written = 0;
+  // stores are 32 bytes wide, and the last quantum is left to the scalar path
+  for (; i + 64 <= n; i += 32) {
+    auto str = simd::load256(in + i);
+    auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), nibble);
+    auto lo_nibbles = _mm256_and_si256(str, nibble);
+    auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) {
+      break;
+    }
+    auto row = hi_nibbles;
+    if constexpr (luts.num_escaped > 0) {
+      auto escaped =
+          _mm256_cmpeq_epi8(str, _mm256_set1_epi8(luts.escaped[0]));
+      if constexpr (luts.num_escaped > 1) {
+        escaped = _mm256_or_si256(
+            escaped,
+            _mm256_cmpeq_epi8(str, _mm256_set1_epi8(luts.escaped[1])));
+      }
+      row = _mm256_or_si256(row,
+                            _mm256_and_si256(escaped, _mm256_set1_epi8(8)));
+    }
+    auto values = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll, row));
+
+    auto merged = _mm256_madd_epi16(
+        _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)),
+        _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, pack_shuffle);
+    simd::store256(out + written,
+                   _mm256_permutevar8x32_epi32(merged, pack_lanes));
+    written += 24;
+  }
+
+  size_t tail_written;
+  auto pos = i + decode_scalar<Alphabet>(in + i, n - i, out + written,
+                                         tail_written);
+  written += tail_written;
+  return pos;
+}
+#endif
+
+// The encoders encode the n bytes of in into encoded_size(n) characters of
+// out, padding the last quantum if the alphabet is padded.
+
+template <class Alphabet = Standard> constexpr size_t encoded_size(size_t n) {
+  return is_padded<Alphabet>() ? 4 * ((n + 2) / 3) : (4 * n + 2) / 3;
+}
+
+template <class Alphabet = Standard>
+void encode_scalar(const byte *in, size_t n, char *out) {
+  constexpr auto alphabet = Alphabet::alphabet;
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    unsigned int triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+    *out++ = alphabet[triple >> 18];
+    *out++ = alphabet[(triple >> 12) & 0x3f];
+    *out++ = alphabet[(triple >> 6) & 0x3f];
+    *out++ = alphabet[triple & 0x3f];
+  }
+
+  if (n - i == 0) {
+    return;
+  }
+  // last quantum: "xx==" for 1 byte left, "xxx=" for 2 bytes left
+  unsigned int triple = in[i] << 16;
+  if (n - i == 2) {
+    triple |= in[i + 1] << 8;
+  }
+  *out++ = alphabet[triple >> 18];
+  *out++ = alphabet[(triple >> 12) & 0x3f];
+  if (n - i == 2) {
+    *out++ = alphabet[(triple >> 6) & 0x3f];
+  } else if (is_padded<Alphabet>()) {
+    *out++ = Alphabet::padding;
+  }
+  if (is_padded<Alphabet>()) {
+    *out++ = Alphabet::padding;
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+// Vectorized encoding from the same paper: 24 bytes are spread into 32
+// 6-bit values with a shuffle and two multiplies, and each value is mapped
+// to its character by adding a per-range offset. Values 62 and 63 have a
+// range each, so their offsets come from the alphabet.
+template <class Alphabet = Standard>
+TARGET_AVX2 void encode_avx2(const byte *in, size_t n, char *out) {
+  static_assert(is_vectorizable<Alphabet>(), "alphabet not vectorizable");
+  const auto spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+      4, 7, 6, 8, 7, 10, 9, 11, 10);
+  constexpr char offset_62 = Alphabet::alphabet[62] - 62;
+  constexpr char offset_63 = Alphabet::alphabet[63] - 63;
+  const auto lut_offsets = _mm256_setr_epi8(
+      65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, offset_62, offset_63, 0,
+      0, 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, offset_62, offset_63,
+      0, 0);
+
+  size_t i = 0;
+  // each step loads 12 + 16 bytes
+  for (; i + 32 <= n; i += 24, out += 32) {
+    auto str = _mm256_set_m128i(simd::load128(in + i + 12),
+                                simd::load128(in + i));
+    str = _mm256_shuffle_epi8(str, spread);
+    auto t0 = _mm256_mulhi_epu16(
+        _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00)),
+        _mm256_set1_epi32(0x04000040));
+    auto t1 = _mm256_mullo_epi16(
+        _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0)),
+        _mm256_set1_epi32(0x01000010));
+    auto values = _mm256_or_si256(t0, t1);
+
+    auto ranges = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+    ranges = _mm256_sub_epi8(
+        ranges, _mm256_cmpgt_epi8(values, _mm256_set1_epi8(25)));
+    simd::store256(out, _mm256_add_epi8(
+                            values, _mm256_shuffle_epi8(lut_offsets, ranges)));
+  }
+  encode_scalar<Alphabet>(in + i, n - i, out);
+}
+#endif
+
+// Alphabets that are not vectorizable always use the scalar kernels
+template <class Alphabet = Standard>
+size_t decode(const char *in, size_t n, byte *out, size_t &written) {
+#ifdef CRYPTOPALS_X86
+  if constexpr (is_vectorizable<Alphabet>()) {
+    static const auto kernel =
+        simd::pick(decode_scalar<Alphabet>, decode_scalar<Alphabet>,
+                   decode_avx2<Alphabet>, decode_avx2<Alphabet>);
+    return kernel(in, n, out, written);
+  }
+#endif
+  return decode_scalar<Alphabet>(in, n, out, written);
+}
+
+template <class Alphabet = Standard>
+void encode(const byte *in, size_t n, char *out) {
+#ifdef CRYPTOPALS_X86
+  if constexpr (is_vectorizable<Alphabet>()) {
+    static const auto kernel =
+        simd::pick(encode_scalar<Alphabet>, encode_scalar<Alphabet>,
+                   encode_avx2<Alphabet>, encode_avx2<Alphabet>);
+    kernel(in, n, out);
+    return;
+  }
+#endif
+  encode_scalar<Alphabet>(in, n, out);
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Whitespace kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// The counters return the number of non-whitespace characters of in. The
+// compactors copy the non-whitespace characters of in to out until capacity
+// characters are written; they set consumed to the number of characters read
+// and return the number of characters written.
+
+namespace whitespace {
+size_t count_scalar(const char *in, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += !is_space(in[i]);
+  }
+  return count;
+}
+
+size_t compact_scalar(const char *in, size_t n, char *out, size_t capacity,
+                      size_t &consumed) {
+  size_t i = 0;
+  size_t written = 0;
+  for (; i < n && written < capacity; i++) {
+    out[written] = in[i];
+    written += !is_space(in[i]);
+  }
+  consumed = i;
+  return written;
+}
+
+#ifdef CRYPTOPALS_X86
+TARGET_AVX2 inline unsigned int space_mask(__m256i c) {
+  auto space = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                      _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r')),
+                      _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t'))));
+  return static_cast<unsigned int>(_mm256_movemask_epi8(space));
+}
+
+TARGET_AVX2 size_t count_avx2(const char *in, size_t n) {
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    count += 32 - __builtin_popcount(space_mask(simd::load256(in + i)));
+  }
+  return count + count_scalar(in + i, n - i);
+}
+
+// Byte shuffle moving the bytes of an 8-byte group selected by a mask to
+// its front, one index per byte, the unused ones zeroed
+constexpr std::array<uint64_t, 256> make_compact_shuffles() {
+  std::array<uint64_t, 256> shuffles{};
+  for (unsigned int mask = 0; mask < 256; mask++) {
+    uint64_t shuffle = ~uint64_t(0); // 0xff bytes give zeros
+    unsigned int kept = 0;
+    for (unsigned int j = 0; j < 8; j++) {
+      if (mask & (1u << j)) {
+        shuffle &= ~(uint64_t(0xff) << (8 * kept));
+        shuffle |= uint64_t(j) << (8 * kept);
+        kept++;
+      }
+    }
+    shuffles[mask] = shuffle;
+  }
+  return shuffles;
+}
+
+static constexpr auto compact_shuffles = make_compact_shuffles();
+
+// Blocks without whitespace, the common case, are copied whole. Others are
+// compacted 8 bytes at a time with a shuffle looked up by their mask of
+// non-whitespace bytes; each group stores 8 bytes, of which the kept ones
+// stay as the next group is stored after them.
+TARGET_AVX2 size_t compact_avx2(const char *in, size_t n, char *out,
+                                size_t capacity, size_t &consumed) {
+  size_t i = 0;
+  size_t written = 0;
+  for (; i + 32 <= n && written + 32 <= capacity; i += 32) {
+    auto block = simd::load256(in + i);
+    auto keep = ~space_mask(block);
+    if (keep == ~0u) {
+      simd::store256(out + written, block);
+      written += 32;
+      continue;
+    }
+    for (unsigned int g = 0; g < 4; g++) {
+      auto group_keep = (keep >> (8 * g)) & 0xff;
+      auto group = _mm_loadl_epi64(
+          reinterpret_cast<const __m128i *>(in + i + 8 * g));
+      auto shuffle = _mm_cvtsi64_si128(
+          static_cast<long long>(compact_shuffles[group_keep]));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(out + written),
+                       _mm_shuffle_epi8(group, shuffle));
+      written += __builtin_popcount(group_keep);
+    }
+  }
+  auto tail = compact_scalar(in + i, n - i, out + written, capacity - written,
+                             consumed);
+  consumed += i;
+  return written + tail;
+}
+#endif
+
+size_t count(const char *in, size_t n) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(count_scalar, count_scalar, count_avx2, count_avx2);
+  return kernel(in, n);
+#else
+  return count_scalar(in, n);
+#endif
+}
+
+size_t compact(const char *in, size_t n, char *out, size_t capacity,
+               size_t &consumed) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(compact_scalar, compact_scalar, compact_avx2, compact_avx2);
+  return kernel(in, n, out, capacity, consumed);
+#else
+  return compact_scalar(in, n, out, capacity, consumed);
+#endif
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Memory-mapped files
+///////////////////////////////////////////////////////////////////////////////
+
+// Read-only mapping of a whole file, advised for sequential access. With
+// populate, the pages are faulted in by mmap itself.
+class MappedFile {
+public:
+  explicit MappedFile(std::experimental::string_view filename,
+                      bool populate = false) {
+    auto fd = ::open(filename.data(), O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error("open failed");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+      ::close(fd);
+      throw std::runtime_error("fstat failed");
+    }
+    size_ = static_cast<size_t>(st.st_size);
+
+    if (size_ > 0) { // empty files cannot be mapped
+      auto flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+      if (populate) {
+        flags |= MAP_POPULATE;
+      }
+#endif
+      data_ = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+      if (data_ == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("mmap failed");
+      }
+      ::madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+  }
+
+  ~MappedFile() {
+    if (size_ > 0) {
+      ::munmap(data_, size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  std::experimental::string_view text() const {
+    return {static_cast<const char *>(data_), size_};
+  }
+  size_t size() const { return size_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Calls f on each line of text, without its '\n'. As with std::getline, a
+// last '\n' does not start an empty line.
+template <class Function>
+void for_each_line(std::experimental::string_view text, Function f) {
+  auto first = text.data();
+  auto last = text.data() + text.size();
+  while (first != last) {
+    auto newline = static_cast<const char *>(
+        std::memchr(first, '\n', static_cast<size_t>(last - first)));
+    auto line_end = newline ? newline : last;
+    f(std::experimental::string_view(first, line_end - first));
+    first = newline ? newline + 1 : last;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Line index
+///////////////////////////////////////////////////////////////////////////////
+
+// The kernels append to starts the position following each '\n' of the n
+// characters of in, shifted by offset.
+
+namespace lines {
+void find_starts_scalar(const char *in, size_t n, size_t offset,
+                        std::vector<size_t> &starts) {
+  auto first = in;
+  auto last = in + n;
+  while (auto newline = static_cast<const char *>(
+             std::memchr(first, '\n', static_cast<size_t>(last - first)))) {
+    starts.push_back(offset + (newline - in) + 1);
+    first = newline + 1;
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+TARGET_SSE41 void find_starts_sse41(const char *in, size_t n, size_t offset,
+                                    std::vector<size_t> &starts) {
+  const auto newline = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto mask = static_cast<unsigned int>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(simd::load128(in + i), newline)));
+    for (; mask != 0; mask &= mask - 1) {
+      starts.push_back(offset + i + __builtin_ctz(mask) + 1);
+    }
+  }
+  find_starts_scalar(in + i, n - i, offset + i, starts);
+}
+
+TARGET_AVX2 void find_starts_avx2(const char *in, size_t n, size_t offset,
+                                  std::vector<size_t> &starts) {
+  const auto newline = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(simd::load256(in + i), newline)));
+    for (; mask != 0; mask &= mask - 1) {
+      starts.push_back(offset + i + __builtin_ctz(mask) + 1);
+    }
+  }
+  find_starts_scalar(in + i, n - i, offset + i, starts);
+}
+
+TARGET_AVX512 void find_starts_avx512(const char *in, size_t n, size_t offset,
+                                      std::vector<size_t> &starts) {
+  const auto newline = _mm512_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    auto mask = _mm512_cmpeq_epi8_mask(simd::load512(in + i), newline);
+    for (; mask != 0; mask &= mask - 1) {
+      starts.push_back(offset + i + __builtin_ctzll(mask) + 1);
+    }
+  }
+  find_starts_scalar(in + i, n - i, offset + i, starts);
+}
+#endif
+
+void find_starts(const char *in, size_t n, size_t offset,
+                 std::vector<size_t> &starts) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(find_starts_scalar, find_starts_sse41, find_starts_avx2,
+                 find_starts_avx512);
+  kernel(in, n, offset, starts);
+#else
+  find_starts_scalar(in, n, offset, starts);
+#endif
+}
+}
+
+// Start offsets of the lines of a text, giving each line in O(1). Lines do
+// not include their '\n', and as with std::getline a last '\n' does not
+// start an empty line.
+class LineIndex {
+public:
+  explicit LineIndex(std::experimental::string_view text) : text_(text) {
+    starts_.push_back(0);
+    lines::find_starts(text.data(), text.size(), 0, starts_);
+    if (starts_.back() != text.size()) { // last line without '\n'
+      starts_.push_back(text.size() + 1);
+    }
+  }
+
+  // Index of text read back from starts, as returned by starts()
+  LineIndex(std::experimental::string_view text, std::vector<size_t> starts)
+      : text_(text), starts_(std::move(starts)) {
+    assert(!starts_.empty() && starts_.front() == 0);
+  }
+
+  size_t size() const { return starts_.size() - 1; }
+
+  std::experimental::string_view operator[](size_t i) const {
+    assert(i < size());
+    return text_.substr(starts_[i], starts_[i + 1] - starts_[i] - 1);
+  }
+
+  // Position of line i in the text
+  size_t offset(size_t i) const { return starts_[i]; }
+
+  const std::vector<size_t> &starts() const { return starts_; }
+
+  // Splits the lines into num_ranges consecutive ranges of about the same
+  // number of bytes. Range k holds lines [bounds[k], bounds[k + 1]).
+  std::vector<size_t> split(unsigned int num_ranges) const {
+    assert(num_ranges > 0);
+    std::vector<size_t> bounds(num_ranges + 1);
+    for (unsigned int k = 1; k < num_ranges; k++) {
+      auto target = text_.size() * k / num_ranges;
+      bounds[k] = std::lower_bound(starts_.begin(), starts_.end() - 1, target) -
+                  starts_.begin();
+    }
+    bounds[num_ranges] = size();
+    return bounds;
+  }
+
+private:
+  std::experimental::string_view text_;
+  std::vector<size_t> starts_;
+};
+
+// Header of a saved line index, identifying the indexed file by size and
+// modification time
+struct LineIndexHeader {
+  std::array<char, 8> magic;
+  uint64_t file_size;
+  int64_t file_mtime_ns;
+  uint64_t num_starts;
+};
+
+static constexpr std::array<char, 8> line_index_magic{
+    {'L', 'I', 'D', 'X', 'v', '1', 0, 0}};
+
+// Whether an index file of size bytes holds the starts of header, checked
+// before allocating them
+bool is_index_size(const LineIndexHeader &header, uint64_t size) {
+  return header.num_starts <= size / sizeof(size_t) &&
+         sizeof(header) + header.num_starts * sizeof(size_t) == size;
+}
+
+// Line index of filename, whose mapped contents are text. The index saved in
+// filename + ".idx" is used if it matches the file and its size; otherwise
+// the index is built and, with save, written there. An index that cannot be
+// written, as in a read-only directory, is only kept in memory.
+LineIndex load_line_index(std::experimental::string_view filename,
+                          std::experimental::string_view text,
+                          bool save = true) {
+  struct stat st;
+  if (::stat(filename.data(), &st) == -1) {
+    throw std::runtime_error("stat failed");
+  }
+  LineIndexHeader expected{
+      line_index_magic, static_cast<uint64_t>(st.st_size),
+      st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, 0};
+  auto index_filename = std::string(filename) + ".idx";
+
+  struct stat index_st;
+  std::ifstream input(index_filename, std::ios::binary);
+  LineIndexHeader header;
+  if (::stat(index_filename.c_str(), &index_st) == 0 &&
+      input.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+      header.magic == expected.magic &&
+      header.file_size == expected.file_size &&
+      header.file_mtime_ns == expected.file_mtime_ns &&
+      is_index_size(header, static_cast<uint64_t>(index_st.st_size))) {
+    std::vector<size_t> starts(header.num_starts);
+    if (input.read(reinterpret_cast<char *>(starts.data()),
+                   starts.size() * sizeof(size_t)) &&
+        !starts.empty() && starts.front() == 0 &&
+        std::is_sorted(starts.begin(), starts.end()) &&
+        starts.back() <= text.size() + 1) {
+      return LineIndex(text, std::move(starts));
+    }
+  }
+
+  LineIndex index(text);
+  if (save) {
+    expected.num_starts = index.starts().size();
+    std::ofstream output(index_filename, std::ios::binary);
+    output.write(reinterpret_cast<const char *>(&expected), sizeof(expected));
+    output.write(reinterpret_cast<const char *>(index.starts().data()),
+                 index.starts().size() * sizeof(size_t));
+    output.close();
+    if (!output) {
+      std::remove(index_filename.c_str());
+    }
+  }
+  return index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Byte vector functions
+///////////////////////////////////////////////////////////////////////////////
+
+// The functions below take the base64 alphabet as a template parameter,
+// standard by default. It only matters in base64 mode.
+
+// Size of the buffer needed to decode n characters
+template <class Alphabet = base64::Standard>
+constexpr size_t required_size(Encoding mode, size_t n) {
+  switch (mode) {
+  case Encoding::hex:
+    return n / 2; // 2 hex digits per 1 byte
+  case Encoding::ascii:
+    return n;
+  case Encoding::base64:
+    return base64::decoded_size<Alphabet>(n);
+  }
+  return n;
+}
+
+// Size of the buffer needed to encode n bytes
+template <class Alphabet = base64::Standard>
+constexpr size_t encoded_size(Encoding mode, size_t n) {
+  switch (mode) {
+  case Encoding::hex:
+    return 2 * n;
+  case Encoding::ascii:
+    return n;
+  case Encoding::base64:
+    return base64::encoded_size<Alphabet>(n);
+  }
+  return n;
+}
+
+// Decodes s into out, which must hold required_size(mode, s.size()) bytes,
+// and returns the number of bytes written. error_pos is set to the position
+// of the first invalid character of s, or to s.size() if s was decoded
+// entirely. On error, only the bytes decoded before error_pos are written.
+template <class Alphabet = base64::Standard>
+size_t string_to_bytes(std::experimental::string_view s, span<byte> out,
+                       Encoding mode, size_t &error_pos) {
+  assert(out.size() >= required_size<Alphabet>(mode, s.size()));
+  size_t written = 0;
+  error_pos = s.size();
+
+  switch (mode) {
+  case Encoding::hex: {
+    error_pos = hex::decode(s.data(), s.size(), out.data());
+    written = error_pos / 2;
+    break;
+  }
+  case Encoding::ascii: {
+    written = std::copy(s.begin(), s.end(), out.begin()) - out.begin();
+    break;
+  }
+  case Encoding::base64: {
+    error_pos =
+        base64::decode<Alphabet>(s.data(), s.size(), out.data(), written);
+    break;
+  }
+  }
+
+  return written;
+}
+
+// Simple version asserting a valid input
+template <class Alphabet = base64::Standard>
+size_t string_to_bytes(std::experimental::string_view s, span<byte> out,
+                       Encoding mode = Encoding::hex) {
+  size_t error_pos;
+  auto written = string_to_bytes<Alphabet>(s, out, mode, error_pos);
+  assert(error_pos == s.size());
+  return written;
+}
+
+template <class Alphabet = base64::Standard>
+std::vector<byte> string_to_bytes(std::experimental::string_view s,
+                                  Encoding mode, size_t &error_pos) {
+  std::vector<byte> byte_vector(required_size<Alphabet>(mode, s.size()));
+  byte_vector.resize(
+      string_to_bytes<Alphabet>(s, byte_vector, mode, error_pos));
+  return byte_vector;
+}
+
+template <class Alphabet = base64::Standard>
+std::vector<byte> string_to_bytes(std::experimental::string_view s,
+                                  Encoding mode = Encoding::hex) {
+  size_t error_pos;
+  auto byte_vector = string_to_bytes<Alphabet>(s, mode, error_pos);
+  assert(error_pos == s.size());
+  return byte_vector;
+}
+
+// Encodes bytes into out, which must hold encoded_size(mode, bytes.size())
+// characters, and returns the number of characters written.
+template <class Alphabet = base64::Standard>
+size_t bytes_to_string(span<const byte> bytes, span<char> out,
+                       Encoding mode = Encoding::hex) {
+  assert(out.size() >= encoded_size<Alphabet>(mode, bytes.size()));
+
+  switch (mode) {
+  case Encoding::hex: {
+    hex::encode(bytes.data(), bytes.size(), out.data());
+    break;
+  }
+  case Encoding::ascii: {
+    std::copy(bytes.begin(), bytes.end(), out.begin());
+    break;
+  }
+  case Encoding::base64: {
+    base64::encode<Alphabet>(bytes.data(), bytes.size(), out.data());
+    break;
+  }
+  }
+
+  return encoded_size<Alphabet>(mode, bytes.size());
+}
+
+template <class Alphabet = base64::Standard>
+std::string bytes_to_string(const std::vector<byte> &byte_vector,
+                            Encoding mode = Encoding::hex) {
+  std::string s(encoded_size<Alphabet>(mode, byte_vector.size()), 0);
+  bytes_to_string<Alphabet>(byte_vector, s, mode);
+  return s;
+}
+
+std::ostream &operator<<(std::ostream &stream,
+                         const std::vector<byte> &byte_vector) {
+  stream.write(reinterpret_cast<const char *>(byte_vector.data()),
+               byte_vector.size());
+  return stream;
+}
+
+// Bytes to write encoded, e.g. stream << as_hex(bytes)
+template <class Alphabet = base64::Standard> struct EncodedBytes {
+  span<const byte> bytes;
+  Encoding mode;
+};
+
+EncodedBytes<> as_hex(span<const byte> bytes) {
+  return {bytes, Encoding::hex};
+}
+
+template <class Alphabet = base64::Standard>
+EncodedBytes<Alphabet> as_base64(span<const byte> bytes) {
+  return {bytes, Encoding::base64};
+}
+
+// Encodes through a fixed stack buffer, chunks being whole base64 quanta
+template <class Alphabet>
+std::ostream &operator<<(std::ostream &stream,
+                         const EncodedBytes<Alphabet> &encoded) {
+  static constexpr size_t chunk_size = 3 * 1024;
+  // hex is the widest encoding
+  std::array<char, encoded_size(Encoding::hex, chunk_size)> buffer;
+
+  auto bytes = encoded.bytes;
+  for (size_t i = 0; i < bytes.size() && stream; i += chunk_size) {
+    auto chunk = bytes.subspan(i, std::min(chunk_size, bytes.size() - i));
+    auto n = bytes_to_string<Alphabet>(chunk, buffer, encoded.mode);
+    stream.write(buffer.data(), n);
+  }
+  return stream;
+}
+
+// Incremental decoder: the input is fed chunk by chunk, and the characters
+// of an incomplete quantum (4 base64 chars or 2 hex digits) are kept for the
+// next chunk. In hex and base64 modes, whitespace is dropped while copying the
+// input to a fixed buffer, which is then decoded in a single kernel call.
+template <class Alphabet = base64::Standard> class StreamDecoder {
+public:
+  explicit StreamDecoder(Encoding mode = Encoding::hex) : mode_(mode) {}
+
+  // Size of the buffer needed by a feed of n characters
+  size_t required_size(size_t n) const {
+    return ::required_size<Alphabet>(mode_, pending_size_ + n);
+  }
+
+  // Decodes chunk into out and returns the number of bytes written. Nothing
+  // is decoded once an invalid character has been found.
+  size_t feed(std::experimental::string_view chunk, span<byte> out) {
+    assert(out.size() >= required_size(chunk.size()));
+    size_t written = 0;
+
+    if (mode_ == Encoding::ascii) {
+      std::copy(chunk.begin(), chunk.end(), out.begin());
+      written = chunk.size();
+      position_ += chunk.size();
+      return written;
+    }
+
+    size_t i = 0;
+    while (i < chunk.size() && !failed_) {
+      // buffer_ starts with the kept characters
+      auto first = i;
+      size_t consumed;
+      auto n = pending_size_ +
+               whitespace::compact(chunk.data() + i, chunk.size() - i,
+                                   buffer_.data() + pending_size_,
+                                   buffer_.size() - pending_size_, consumed);
+      i += consumed;
+
+      auto aligned = n - n % quantum_size();
+      size_t error_offset;
+      written += decode_block(buffer_.data(), aligned, out.data() + written,
+                              error_offset);
+      if (error_offset < aligned) {
+        fail(error_offset < pending_size_
+                 ? pending_pos_[error_offset]
+                 : position_ + nth_data_char(chunk, first,
+                                             error_offset - pending_size_));
+        break;
+      }
+
+      // keep the characters after the last quantum, walking back from i
+      std::array<size_t, 4> kept_pos = {};
+      auto j = i;
+      for (auto k = n; k > aligned; k--) {
+        if (k <= pending_size_) {
+          kept_pos[k - 1 - aligned] = pending_pos_[k - 1];
+          continue;
+        }
+        do {
+          j--;
+        } while (is_space(chunk[j]));
+        kept_pos[k - 1 - aligned] = position_ + j;
+      }
+      std::copy(buffer_.begin() + aligned, buffer_.begin() + n,
+                buffer_.begin());
+      pending_pos_ = kept_pos;
+      pending_size_ = n - aligned;
+    }
+    position_ += chunk.size();
+    return written;
+  }
+
+  // Decodes the characters kept from the last feed and returns the number of
+  // bytes written. An incomplete last quantum is invalid, except for 2 or 3
+  // characters of an unpadded base64 alphabet.
+  size_t finish(span<byte> out) {
+    if (failed_ || pending_size_ == 0) {
+      return 0;
+    }
+    size_t error_offset;
+    auto written = decode_block(buffer_.data(), pending_size_, out.data(),
+                                error_offset);
+    if (error_offset < pending_size_) {
+      fail(pending_pos_[error_offset]);
+    }
+    pending_size_ = 0;
+    return written;
+  }
+
+  bool failed() const { return failed_; }
+  // Whether base64 padding ended the stream
+  bool ended() const { return ended_; }
+  // Position in the stream of the first invalid character
+  size_t error_pos() const { return error_pos_; }
+
+private:
+  size_t quantum_size() const { return mode_ == Encoding::base64 ? 4 : 2; }
+
+  void fail(size_t pos) {
+    failed_ = true;
+    error_pos_ = pos;
+  }
+
+  // Position in chunk of the k-th non-whitespace character from first
+  static size_t nth_data_char(std::experimental::string_view chunk,
+                              size_t first, size_t k) {
+    for (auto i = first;; i++) {
+      if (!is_space(chunk[i]) && k-- == 0) {
+        return i;
+      }
+    }
+  }
+
+  // Decodes n characters without whitespace, setting error_offset to the
+  // offset of the first invalid one, or to n
+  size_t decode_block(const char *in, size_t n, byte *out,
+                      size_t &error_offset) {
+    size_t written = 0;
+    error_offset = 0;
+    if (n == 0 || ended_) { // nothing may follow base64 padding
+      return written;
+    }
+
+    if (mode_ == Encoding::base64) {
+      // anything after the quantum holding the padding is invalid
+      auto padding = base64::is_padded<Alphabet>()
+                         ? static_cast<const char *>(
+                               std::memchr(in, Alphabet::padding, n))
+                         : nullptr;
+      auto end =
+          padding ? std::min<size_t>(n, (padding - in) / 4 * 4 + 4) : n;
+      error_offset = base64::decode<Alphabet>(in, end, out, written);
+      ended_ = written < base64::decoded_size<Alphabet>(end);
+    } else {
+      error_offset = hex::decode(in, n, out);
+      written = error_offset / 2;
+    }
+    return written;
+  }
+
+  Encoding mode_;
+  bool failed_ = false;
+  bool ended_ = false;
+  size_t error_pos_ = 0;
+  size_t position_ = 0;
+  std::array<char, 4096> buffer_;
+  std::array<size_t, 4> pending_pos_ = {};
+  size_t pending_size_ = 0;
+};
+
+// Decodes the text of filename. In ascii mode, the lines are joined without
+// their '\n', as whitespace is skipped in the other modes.
+template <class Alphabet = base64::Standard>
+std::vector<byte> file_to_bytes(std::experimental::string_view filename,
+                                Encoding mode = Encoding::hex) {
+  MappedFile file(filename);
+  if (mode == Encoding::ascii) {
+    std::vector<byte> bytes;
+    bytes.reserve(file.size());
+    for_each_line(file.text(), [&](auto line) {
+      bytes.insert(bytes.end(), line.begin(), line.end());
+    });
+    return bytes;
+  }
+
+  StreamDecoder<Alphabet> decoder(mode);
+  std::vector<byte> bytes(decoder.required_size(file.size()));
+  bytes.resize(decoder.feed(file.text(), bytes));
+
+  std::array<byte, 3> tail; // at most one quantum is kept
+  auto written = decoder.finish(tail);
+  bytes.insert(bytes.end(), tail.begin(), tail.begin() + written);
+  assert(!decoder.failed());
+
+  return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel decoding
+///////////////////////////////////////////////////////////////////////////////
+
+// Decodes s as string_to_bytes does, skipping whitespace in hex and base64
+// modes, with num_threads threads. s is cut into one chunk per thread at
+// quantum boundaries of the decoded characters, so that each chunk is decoded
+// straight to its final place in out.
+template <class Alphabet = base64::Standard>
+size_t parallel_decode(std::experimental::string_view s, span<byte> out,
+                       Encoding mode, unsigned int num_threads,
+                       size_t &error_pos) {
+  assert(out.size() >= required_size<Alphabet>(mode, s.size()));
+  static constexpr size_t min_chunk_size = 1 << 20;
+  num_threads = static_cast<unsigned int>(std::max<size_t>(
+      1, std::min<size_t>(num_threads, s.size() / min_chunk_size)));
+
+  size_t quantum_size = mode == Encoding::base64 ? 4
+                        : mode == Encoding::hex  ? 2
+                                                 : 1;
+  size_t quantum_bytes = mode == Encoding::base64 ? 3 : 1;
+  auto is_data = [mode](char c) {
+    return mode == Encoding::ascii || !is_space(c);
+  };
+
+  // Count the decoded characters of equal ranges of s, but the last, which
+  // no bound follows
+  std::vector<size_t> bounds(num_threads + 1);
+  std::vector<size_t> counts(num_threads);
+  for (unsigned int k = 0; k <= num_threads; k++) {
+    bounds[k] = s.size() * k / num_threads;
+  }
+  run_parallel(num_threads, [&](unsigned int k) {
+    if (k + 1 == num_threads) {
+      return;
+    }
+    auto size = bounds[k + 1] - bounds[k];
+    counts[k] = mode == Encoding::ascii
+                    ? size
+                    : whitespace::count(s.data() + bounds[k], size);
+  });
+
+  // Move each bound forward to a quantum boundary
+  std::vector<size_t> offsets(num_threads);
+  size_t data_before = 0; // decoded characters before the raw bound
+  for (unsigned int k = 1; k < num_threads; k++) {
+    data_before += counts[k - 1];
+    auto pos = bounds[k];
+    auto data = data_before;
+    if (pos < bounds[k - 1]) { // the previous bound moved past this one
+      pos = bounds[k - 1];
+      data = offsets[k - 1] / quantum_bytes * quantum_size;
+    }
+    while (data % quantum_size != 0 && pos < s.size()) {
+      data += is_data(s[pos++]);
+    }
+    bounds[k] = pos;
+    offsets[k] = data / quantum_size * quantum_bytes;
+  }
+
+  std::vector<size_t> written(num_threads);
+  std::vector<size_t> errors(num_threads, s.size());
+  run_parallel(num_threads, [&](unsigned int k) {
+    StreamDecoder<Alphabet> decoder(mode);
+    auto chunk = s.substr(bounds[k], bounds[k + 1] - bounds[k]);
+    // the decoder only writes the decoded size of its chunk
+    auto chunk_out = out.subspan(offsets[k], out.size() - offsets[k]);
+    written[k] = decoder.feed(chunk, chunk_out);
+    written[k] += decoder.finish(chunk_out.subspan(
+        written[k], chunk_out.size() - written[k]));
+
+    if (decoder.failed()) {
+      errors[k] = bounds[k] + decoder.error_pos();
+    } else if (decoder.ended() && k + 1 < num_threads) {
+      // nothing may follow base64 padding
+      auto next = std::find_if(s.begin() + bounds[k + 1], s.end(), is_data);
+      errors[k] = next - s.begin();
+    }
+  });
+
+  error_pos = s.size();
+  for (unsigned int k = 0; k < num_threads; k++) {
+    if (errors[k] < s.size() || k + 1 == num_threads) {
+      error_pos = errors[k];
+      return offsets[k] + written[k];
+    }
+  }
+  return 0;
+}
+
+template <class Alphabet = base64::Standard>
+std::vector<byte> parallel_decode(std::experimental::string_view s,
+                                  Encoding mode,
+                                  unsigned int num_threads,
+                                  size_t &error_pos) {
+  std::vector<byte> byte_vector(required_size<Alphabet>(mode, s.size()));
+  byte_vector.resize(parallel_decode<Alphabet>(s, byte_vector, mode,
+                                               num_threads, error_pos));
+  return byte_vector;
+}
+
+// Simple version asserting a valid input
+template <class Alphabet = base64::Standard>
+std::vector<byte> parallel_decode(std::experimental::string_view s,
+                                  Encoding mode = Encoding::hex,
+                                  unsigned int num_threads =
+                                      default_num_threads()) {
+  size_t error_pos;
+  auto byte_vector =
+      parallel_decode<Alphabet>(s, mode, num_threads, error_pos);
+  assert(error_pos == s.size());
+  return byte_vector;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encoding detection
+///////////////////////////////////////////////////////////////////////////////
+
+// Character classes are looked up by nibble, as the AND of a low and a high
+// nibble table, so that the vector kernels need only two shuffles per block.
+// Each class bit covers a rectangle of the ascii table:
+//   digit      '0'-'9'             letter_hi  'P'-'Z', 'p'-'z'
+//   hex_letter 'A'-'F', 'a'-'f'    symbol     '+', '/'
+//   letter_lo  'A'-'O', 'a'-'o'    padding    '='
+//   control    '\t', '\n', '\r'    space      ' '
+
+namespace detect {
+enum : byte {
+  digit = 0x01,
+  hex_letter = 0x02,
+  letter_lo = 0x04,
+  letter_hi = 0x08,
+  symbol = 0x10,
+  padding = 0x20,
+  control = 0x40,
+  space = 0x80,
+};
+
+static constexpr byte whitespace_classes = control | space;
+static constexpr byte hex_classes = digit | hex_letter | whitespace_classes;
+static constexpr byte base64_classes =
+    digit | letter_lo | letter_hi | symbol | padding | whitespace_classes;
+
+alignas(16) static constexpr std::array<byte, 16> low_nibble_classes = {
+    digit | letter_hi | space,                  // 0
+    digit | hex_letter | letter_lo | letter_hi, // 1
+    digit | hex_letter | letter_lo | letter_hi, // 2
+    digit | hex_letter | letter_lo | letter_hi, // 3
+    digit | hex_letter | letter_lo | letter_hi, // 4
+    digit | hex_letter | letter_lo | letter_hi, // 5
+    digit | hex_letter | letter_lo | letter_hi, // 6
+    digit | letter_lo | letter_hi,              // 7
+    digit | letter_lo | letter_hi,              // 8
+    digit | letter_lo | letter_hi | control,    // 9
+    letter_lo | letter_hi | control,            // a
+    letter_lo | symbol,                         // b
+    letter_lo,                                  // c
+    letter_lo | padding | control,              // d
+    letter_lo,                                  // e
+    letter_lo | symbol,                         // f
+};
+
+alignas(16) static constexpr std::array<byte, 16> high_nibble_classes = {
+    control,                // 0
+    0,                      // 1
+    symbol | space,         // 2
+    digit | padding,        // 3
+    hex_letter | letter_lo, // 4
+    letter_hi,              // 5
+    hex_letter | letter_lo, // 6
+    letter_hi,              // 7
+};
+
+constexpr std::array<byte, 256> make_class_table() {
+  std::array<byte, 256> table{};
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i] = low_nibble_classes[i & 0x0f] & high_nibble_classes[i >> 4];
+  }
+  return table;
+}
+
+static constexpr auto class_table = make_class_table();
+
+constexpr byte classes(char c) { return class_table[static_cast<byte>(c)]; }
+
+// Results of the scanners
+static constexpr unsigned int maybe_hex = 1;
+static constexpr unsigned int maybe_base64 = 2;
+
+// The scanners return which of maybe_hex and maybe_base64 the n characters
+// of in allow, ignoring whitespace, and set data_chars to the number of
+// non-whitespace characters. base64 also requires at most two padding
+// characters, with no data after them. The scanners stop early once neither
+// is possible, leaving data_chars unset.
+
+unsigned int scan_scalar(const char *in, size_t n, size_t &data_chars) {
+  bool hex = true;
+  size_t spaces = 0;
+  size_t num_padding = 0;
+  for (size_t i = 0; i < n; i++) {
+    auto c = classes(in[i]);
+    if ((c & base64_classes) == 0 ||
+        (num_padding > 0 && (c & (padding | whitespace_classes)) == 0)) {
+      return 0;
+    }
+    hex &= (c & hex_classes) != 0;
+    spaces += (c & whitespace_classes) != 0;
+    num_padding += (c & padding) != 0;
+  }
+  if (num_padding > 2) {
+    return 0;
+  }
+  data_chars = n - spaces;
+  return maybe_base64 | (hex ? maybe_hex : 0);
+}
+
+#ifdef CRYPTOPALS_X86
+// Lanes below 32 - k of a load at k are set
+alignas(32) static constexpr std::array<int8_t, 64> lane_masks = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+
+// A last partial block overlaps the previous one, with the characters
+// already scanned replaced by spaces, which no class rejects
+TARGET_AVX2 unsigned int scan_avx2(const char *in, size_t n,
+                                   size_t &data_chars) {
+  if (n < 32) {
+    return scan_scalar(in, n, data_chars);
+  }
+  const auto low_table =
+      _mm256_broadcastsi128_si256(simd::load128(low_nibble_classes.data()));
+  const auto high_table =
+      _mm256_broadcastsi128_si256(simd::load128(high_nibble_classes.data()));
+  const auto nibble = _mm256_set1_epi8(0x0f);
+  const auto zero = _mm256_setzero_si256();
+
+  auto not_hex = zero;
+  size_t num_data = 0;
+  size_t num_padding = 0;
+  for (size_t i = 0; i < n; i += 32) {
+    auto block = i + 32 <= n
+                     ? simd::load256(in + i)
+                     : _mm256_blendv_epi8(simd::load256(in + n - 32),
+                                          _mm256_set1_epi8(' '),
+                                          simd::load256(&lane_masks[n - i]));
+    auto low = _mm256_and_si256(block, nibble);
+    auto high = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble);
+    auto c = _mm256_and_si256(_mm256_shuffle_epi8(low_table, low),
+                              _mm256_shuffle_epi8(high_table, high));
+
+    auto not_base64 = _mm256_cmpeq_epi8(
+        _mm256_and_si256(c, _mm256_set1_epi8(base64_classes)), zero);
+    if (!_mm256_testz_si256(not_base64, not_base64)) {
+      return 0;
+    }
+    not_hex = _mm256_or_si256(
+        not_hex, _mm256_cmpeq_epi8(
+                     _mm256_and_si256(c, _mm256_set1_epi8(hex_classes)), zero));
+    auto not_space = _mm256_cmpeq_epi8(
+        _mm256_and_si256(c, _mm256_set1_epi8(whitespace_classes)), zero);
+    auto data_mask = static_cast<unsigned int>(_mm256_movemask_epi8(not_space));
+    num_data += __builtin_popcount(data_mask);
+
+    // padding is rare, and may only be followed by padding and whitespace
+    auto pad = _mm256_set1_epi8(padding);
+    if (num_padding > 0 || !_mm256_testz_si256(c, pad)) {
+      auto is_pad = _mm256_cmpeq_epi8(_mm256_and_si256(c, pad), pad);
+      auto pad_mask = static_cast<unsigned int>(_mm256_movemask_epi8(is_pad));
+      auto after = num_padding > 0 ? ~0u : ~0u << __builtin_ctz(pad_mask);
+      if ((data_mask & ~pad_mask & after) != 0) {
+        return 0;
+      }
+      num_padding += __builtin_popcount(pad_mask);
+    }
+  }
+
+  if (num_padding > 2) {
+    return 0;
+  }
+  data_chars = num_data;
+  return _mm256_testz_si256(not_hex, not_hex) ? maybe_hex | maybe_base64
+                                              : maybe_base64;
+}
+#endif
+
+unsigned int scan(const char *in, size_t n, size_t &data_chars) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(scan_scalar, scan_scalar, scan_avx2, scan_avx2);
+  return kernel(in, n, data_chars);
+#else
+  return scan_scalar(in, n, data_chars);
+#endif
+}
+}
+
+// Guesses the encoding of a line or chunk: hex if it only has hex digits,
+// base64 if it is valid base64, and ascii (raw bytes) otherwise. Whitespace
+// is ignored. Strings that are both, such as "deadbeef", are taken as hex.
+// data_chars is set to the number of non-whitespace characters of a hex or
+// base64 string.
+Encoding detect_encoding(std::experimental::string_view s,
+                         size_t &data_chars) {
+  auto result = detect::scan(s.data(), s.size(), data_chars);
+  if (result == 0 || data_chars == 0) {
+    return Encoding::ascii;
+  }
+  if ((result & detect::maybe_hex) && data_chars % 2 == 0) {
+    return Encoding::hex;
+  }
+  if (data_chars % 4 == 0) {
+    return Encoding::base64;
+  }
+  return Encoding::ascii;
+}
+
+Encoding detect_encoding(std::experimental::string_view s) {
+  size_t data_chars;
+  return detect_encoding(s, data_chars);
+}
+
+// Decodes s with the encoding detected for it, which is stored in mode, into
+// out, which must hold s.size() bytes, and returns the number of bytes
+// written. Only a prefix of s is classified to pick a decoder, which checks
+// the rest; s is classified entirely only when the decoder rejects it.
+size_t decode_detected(std::experimental::string_view s, span<byte> out,
+                       Encoding &mode) {
+  assert(out.size() >= s.size());
+  static constexpr size_t prefix_size = 32;
+  size_t data_chars;
+  auto guess =
+      detect::scan(s.data(), std::min(s.size(), prefix_size), data_chars);
+  if (guess == 0 || s.empty()) {
+    mode = Encoding::ascii;
+    return string_to_bytes(s, out, mode);
+  }
+
+  size_t error_pos;
+  if (guess & detect::maybe_hex) {
+    mode = Encoding::hex;
+    auto written = string_to_bytes(s, out, mode, error_pos);
+    if (error_pos == s.size()) {
+      return written;
+    }
+  }
+  mode = Encoding::base64;
+  auto written = string_to_bytes(s, out, mode, error_pos);
+  if (error_pos == s.size()) {
+    return written;
+  }
+
+  // whitespace, or not hex nor base64 after the prefix
+  mode = detect_encoding(s);
+  if (mode == Encoding::ascii) {
+    return string_to_bytes(s, out, mode);
+  }
+  StreamDecoder decoder(mode);
+  written = decoder.feed(s, out);
+  written += decoder.finish(out.subspan(written, out.size() - written));
+  assert(!decoder.failed());
+  return written;
+}
+
+std::vector<byte> decode_detected(std::experimental::string_view s,
+                                  Encoding &mode) {
+  std::vector<byte> byte_vector(s.size());
+  byte_vector.resize(decode_detected(s, byte_vector, mode));
+  return byte_vector;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compile-time literals
+///////////////////////////////////////////////////////////////////////////////
+
+// Decoding of constant strings at compile time, with invalid characters
+// rejected by static_assert, e.g.
+//   static constexpr char key_hex[] = "49434520";
+//   constexpr auto key = hex_literal<key_hex>(); // std::array<byte, 4>
+
+template <size_t size> struct DecodedLiteral {
+  std::array<byte, size> bytes;
+  size_t written;
+  size_t error_pos;
+};
+
+template <size_t size>
+constexpr DecodedLiteral<size> decode_literal(const char *s, size_t n,
+                                              Encoding mode) {
+  DecodedLiteral<size> result{{}, 0, 0};
+  if (mode == Encoding::hex) {
+    result.error_pos = hex::decode_scalar(s, n, result.bytes.data());
+    result.written = result.error_pos / 2;
+  } else {
+    result.error_pos =
+        base64::decode_scalar(s, n, result.bytes.data(), result.written);
+  }
+  return result;
+}
+
+template <const auto &s> constexpr auto hex_literal() {
+  constexpr auto n = sizeof(s) - 1;
+  constexpr auto result =
+      decode_literal<required_size(Encoding::hex, n)>(s, n, Encoding::hex);
+  static_assert(result.error_pos == n, "invalid hex literal");
+  return result.bytes;
+}
+
+template <const auto &s> constexpr auto b64_literal() {
+  constexpr auto n = sizeof(s) - 1;
+  constexpr auto result = decode_literal<required_size(Encoding::base64, n)>(
+      s, n, Encoding::base64);
+  static_assert(result.error_pos == n, "invalid base64 literal");
+
+  std::array<byte, result.written> bytes{}; // without the padding bytes
+  for (size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = result.bytes[i];
+  }
+  return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Record files
+///////////////////////////////////////////////////////////////////////////////
+
+// A record file holds the decoded lines of a text corpus, so that repeated
+// scans skip the text decoding. It starts with a RecordFileHeader, followed
+// by the file offsets of the num_records records, each one a uint32_t length
+// followed by the record bytes.
+
+struct RecordFileHeader {
+  std::array<char, 8> magic;
+  uint64_t encoding;
+  uint64_t source_size;
+  uint64_t source_checksum;
+  uint64_t num_records;
+};
+
+static constexpr std::array<char, 8> record_file_magic{
+    {'R', 'E', 'C', 'S', 'v', '1', 0, 0}};
+
+// Fast non-cryptographic checksum, used to detect changed sources
+uint64_t checksum(std::experimental::string_view text) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    uint64_t word;
+    std::memcpy(&word, text.data() + i, sizeof(word));
+    h = (h ^ word) * 1099511628211ULL;
+    h ^= h >> 32;
+  }
+  for (; i < text.size(); i++) {
+    h = (h ^ static_cast<byte>(text[i])) * 1099511628211ULL;
+  }
+  return h ^ text.size();
+}
+
+// Writes parts to filename + ".tmp", syncs it and renames it to filename, so
+// that filename is either left as it was or replaced whole
+void replace_file(std::experimental::string_view filename,
+                  std::initializer_list<span<const byte>> parts) {
+  auto temp_filename = std::string(filename) + ".tmp";
+  auto fd = ::open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("open failed");
+  }
+  auto fail = [&](const char *what) {
+    ::close(fd);
+    ::unlink(temp_filename.c_str());
+    throw std::runtime_error(what);
+  };
+  for (auto part : parts) {
+    for (size_t written = 0; written < part.size();) {
+      auto m = ::write(fd, part.data() + written, part.size() - written);
+      if (m == -1 && errno != EINTR) {
+        fail("write failed");
+      }
+      written += m == -1 ? 0 : static_cast<size_t>(m);
+    }
+  }
+  if (::fsync(fd) == -1) {
+    fail("fsync failed");
+  }
+  if (::close(fd) == -1) {
+    ::unlink(temp_filename.c_str());
+    throw std::runtime_error("close failed");
+  }
+  if (::rename(temp_filename.c_str(), filename.data()) == -1) {
+    ::unlink(temp_filename.c_str());
+    throw std::runtime_error("rename failed");
+  }
+}
+
+std::string record_filename(std::experimental::string_view filename) {
+  return std::string(filename) + ".bin";
+}
+
+bool is_record_file(std::experimental::string_view filename) {
+  std::ifstream input(filename.data(), std::ios::binary);
+  std::array<char, 8> magic;
+  return input.read(magic.data(), magic.size()) && magic == record_file_magic;
+}
+
+// Memory-mapped record file. Every record is checked to lie within the file
+// when it is opened.
+class RecordFile {
+public:
+  explicit RecordFile(std::experimental::string_view filename)
+      : file_(filename) {
+    auto text = file_.text();
+    if (text.size() < sizeof(header_)) {
+      throw std::runtime_error("invalid record file");
+    }
+    std::memcpy(&header_, text.data(), sizeof(header_));
+    if (header_.magic != record_file_magic ||
+        header_.num_records >
+            (text.size() - sizeof(header_)) / sizeof(uint64_t)) {
+      throw std::runtime_error("invalid record file");
+    }
+    for (size_t i = 0; i < header_.num_records; i++) {
+      auto offset = record_offset(i);
+      uint32_t length;
+      if (offset > text.size() || text.size() - offset < sizeof(length)) {
+        throw std::runtime_error("invalid record file");
+      }
+      std::memcpy(&length, text.data() + offset, sizeof(length));
+      if (text.size() - offset - sizeof(length) < length) {
+        throw std::runtime_error("invalid record file");
+      }
+    }
+  }
+
+  const RecordFileHeader &header() const { return header_; }
+  size_t size() const { return header_.num_records; }
+
+  span<const byte> operator[](size_t i) const {
+    assert(i < size());
+    auto data = file_.text().data();
+    auto offset = record_offset(i);
+    uint32_t length;
+    std::memcpy(&length, data + offset, sizeof(length));
+    return {reinterpret_cast<const byte *>(data + offset + sizeof(length)),
+            length};
+  }
+
+  // Whether the records were decoded with mode from text
+  bool matches(std::experimental::string_view text, Encoding mode) const {
+    return header_.encoding == static_cast<uint64_t>(mode) &&
+           header_.source_size == text.size() &&
+           header_.source_checksum == checksum(text);
+  }
+
+private:
+  uint64_t record_offset(size_t i) const {
+    uint64_t offset;
+    std::memcpy(&offset,
+                file_.text().data() + sizeof(header_) + i * sizeof(offset),
+                sizeof(offset));
+    return offset;
+  }
+
+  MappedFile file_;
+  RecordFileHeader header_;
+};
+
+// Decodes each line of filename and writes the records to
+// record_filename(filename), replacing it whole. Lengths are 32 bits, so a
+// longer record throws before anything is written.
+void write_record_file(std::experimental::string_view filename,
+                       Encoding mode = Encoding::hex) {
+  MappedFile file(filename);
+  LineIndex index(file.text());
+
+  RecordFileHeader header{record_file_magic, static_cast<uint64_t>(mode),
+                          file.size(), checksum(file.text()), index.size()};
+  std::vector<uint64_t> offsets(index.size());
+  std::vector<byte> records;
+  auto records_offset = sizeof(header) + offsets.size() * sizeof(uint64_t);
+
+  for (size_t i = 0; i < index.size(); i++) {
+    offsets[i] = records_offset + records.size();
+    auto line = index[i];
+    auto length_offset = records.size();
+    records.resize(length_offset + sizeof(uint32_t) +
+                   required_size(mode, line.size()));
+    auto decoded = string_to_bytes(
+        line, {records.data() + length_offset + sizeof(uint32_t),
+               required_size(mode, line.size())},
+        mode);
+    if (decoded > std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("record too long");
+    }
+    auto length = static_cast<uint32_t>(decoded);
+    std::memcpy(records.data() + length_offset, &length, sizeof(length));
+    records.resize(length_offset + sizeof(length) + length);
+  }
+
+  replace_file(record_filename(filename),
+               {{reinterpret_cast<const byte *>(&header), sizeof(header)},
+                {reinterpret_cast<const byte *>(offsets.data()),
+                 offsets.size() * sizeof(uint64_t)},
+                records});
+}
+
+// Calls f on a span<const byte> of the decoded bytes of each line of
+// filename. filename may also be a record file, and record_filename(filename)
+// is read instead of filename when it is up to date; records are then passed
+// in place from the mapping. A record file that fails to open is ignored,
+// like a stale one.
+template <class Function>
+void for_each_record(std::experimental::string_view filename, Encoding mode,
+                     Function f) {
+  auto for_each_in_record_file = [&](const RecordFile &records) {
+    for (size_t i = 0; i < records.size(); i++) {
+      f(records[i]);
+    }
+  };
+
+  if (is_record_file(filename)) {
+    for_each_in_record_file(RecordFile(filename));
+    return;
+  }
+
+  MappedFile file(filename);
+  auto records_name = record_filename(filename);
+  std::unique_ptr<RecordFile> records;
+  if (is_record_file(records_name)) {
+    try {
+      records.reset(new RecordFile(records_name));
+    } catch (const std::runtime_error &) {
+      // truncated or corrupt: decode the text instead
+    }
+  }
+  if (records && records->matches(file.text(), mode)) {
+    for_each_in_record_file(*records);
+    return;
+  }
+
+  std::vector<byte> bytes;
+  for_each_line(file.text(), [&](auto line) {
+    bytes.resize(required_size(mode, line.size()));
+    bytes.resize(string_to_bytes(line, bytes, mode));
+    f(span<const byte>(bytes));
+  });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Xor kernels
+///////////////////////////////////////////////////////////////////////////////
+
+// The kernels xor the n bytes of a and b into dst, which may be a or b.
+
+namespace bitwise {
+void xor_scalar(byte *dst, const byte *a, const byte *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = a[i] ^ b[i];
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+TARGET_SSE41 void xor_sse41(byte *dst, const byte *a, const byte *b,
+                            size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    simd::store128(dst + i,
+                   _mm_xor_si128(simd::load128(a + i), simd::load128(b + i)));
+  }
+  xor_scalar(dst + i, a + i, b + i, n - i);
+}
+
+TARGET_AVX2 void xor_avx2(byte *dst, const byte *a, const byte *b, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    simd::store256(dst + i, _mm256_xor_si256(simd::load256(a + i),
+                                             simd::load256(b + i)));
+  }
+  xor_scalar(dst + i, a + i, b + i, n - i);
+}
+
+// The tail is done with masked loads and stores
+TARGET_AVX512 void xor_avx512(byte *dst, const byte *a, const byte *b,
+                              size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    simd::store512(dst + i, _mm512_xor_si512(simd::load512(a + i),
+                                             simd::load512(b + i)));
+  }
+  if (i < n) {
+    __mmask64 mask = (1ull << (n - i)) - 1;
+    _mm512_mask_storeu_epi8(
+        dst + i, mask,
+        _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, a + i),
+                         _mm512_maskz_loadu_epi8(mask, b + i)));
+  }
+}
+#endif
+
+void xor_bytes(byte *dst, const byte *a, const byte *b, size_t n) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(xor_scalar, xor_sse41, xor_avx2, xor_avx512);
+  kernel(dst, a, b, n);
+#else
+  xor_scalar(dst, a, b, n);
+#endif
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Xor functions
+///////////////////////////////////////////////////////////////////////////////
+
+// Xors a and b, of the size of dst, into dst, which may alias either
+void xor_into(span<byte> dst, span<const byte> a, span<const byte> b) {
+  assert(a.size() == dst.size() && b.size() == dst.size());
+  bitwise::xor_bytes(dst.data(), a.data(), b.data(), dst.size());
+}
+
+void xor_inplace(span<byte> dst, span<const byte> src) {
+  xor_into(dst, dst, src);
+}
+
+std::vector<byte> fixed_xor(const std::vector<byte> &lhs,
+                            const std::vector<byte> &rhs) {
+  assert(lhs.size() == rhs.size());
+
+  std::vector<byte> result(lhs.size());
+  xor_into(result, lhs, rhs);
+  return result;
+}
+
+std::vector<byte> single_byte_xor(const std::vector<byte> &lhs, byte rhs) {
+
+  std::vector<byte> result;
+  result.reserve(lhs.size());
+  std::transform(lhs.begin(), lhs.end(), std::back_inserter(result),
+                 [rhs](byte b) { return b ^ rhs; });
+  return result;
+}
+
+// A key tiled into a pattern whose size is a multiple of the key size and of
+// the widest vector, so that repeating key xor is a few xor_bytes calls over
+// whole patterns. The pattern is at least min_size bytes to amortize the
+// calls, and only the key itself for keys too large to tile.
+class KeyPattern {
+public:
+  static constexpr size_t min_size = 4096;
+  static constexpr size_t max_size = 1 << 20;
+
+  explicit KeyPattern(span<const byte> key) : key_size_(key.size()) {
+    assert(!key.empty());
+    size_t size = std::lcm(key.size(), size_t(64));
+    if (size > max_size) {
+      size = key.size();
+    } else {
+      size *= (min_size + size - 1) / size;
+    }
+    pattern_.resize(size);
+    for (size_t i = 0; i < size; i += key.size()) {
+      std::copy(key.begin(), key.end(), pattern_.begin() + i);
+    }
+  }
+
+  size_t key_size() const { return key_size_; }
+
+  // Xors src with the key stream starting offset bytes into it, into dst,
+  // which may be src. Chunks of a stream are xored with their offsets.
+  void apply(span<byte> dst, span<const byte> src, size_t offset = 0) const {
+    assert(dst.size() == src.size());
+    auto phase = offset % pattern_.size();
+    for (size_t i = 0; i < src.size();) {
+      auto n = std::min(src.size() - i, pattern_.size() - phase);
+      bitwise::xor_bytes(dst.data() + i, src.data() + i,
+                         pattern_.data() + phase, n);
+      i += n;
+      phase = 0;
+    }
+  }
+
+  // apply with num_threads threads, each on a range of src starting at the
+  // key phase of its offset. Ranges are at least min_chunk_size bytes, so
+  // small inputs use fewer threads or just the calling one.
+  void parallel_apply(span<byte> dst, span<const byte> src, size_t offset = 0,
+                      unsigned int num_threads = default_num_threads()) const {
+    assert(dst.size() == src.size());
+    static constexpr size_t min_chunk_size = 1 << 20;
+    num_threads = static_cast<unsigned int>(std::max<size_t>(
+        1, std::min<size_t>(num_threads, src.size() / min_chunk_size)));
+
+    // inner bounds at the start of cache lines of dst, so that threads don't
+    // share any; ranges are 1 MB at least, so they stay ordered
+    auto misalignment = reinterpret_cast<uintptr_t>(dst.data()) % 64;
+    auto bound = [&](unsigned int k) {
+      if (k == 0) {
+        return size_t(0);
+      }
+      if (k == num_threads) {
+        return src.size();
+      }
+      auto raw = src.size() * k / num_threads;
+      return (raw + misalignment) / 64 * 64 - misalignment;
+    };
+    run_parallel(num_threads, [&](unsigned int k) {
+      auto first = bound(k);
+      auto size = bound(k + 1) - first;
+      apply(dst.subspan(first, size), src.subspan(first, size), offset + first);
+    });
+  }
+
+private:
+  size_t key_size_;
+  std::vector<byte> pattern_;
+};
+
+void repeating_key_xor(span<byte> dst, span<const byte> src,
+                       span<const byte> key, size_t key_offset = 0) {
+  KeyPattern(key).apply(dst, src, key_offset);
+}
+
+void parallel_repeating_key_xor(span<byte> dst, span<const byte> src,
+                                span<const byte> key, size_t key_offset = 0,
+                                unsigned int num_threads =
+                                    default_num_threads()) {
+  KeyPattern(key).parallel_apply(dst, src, key_offset, num_threads);
+}
+
+// The key may be longer than lhs
+std::vector<byte> repeating_key_xor(const std::vector<byte> &lhs,
+                                    const std::vector<byte> &rhs) {
+  std::vector<byte> result(lhs.size());
+  repeating_key_xor(result, lhs, rhs);
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming xor
+///////////////////////////////////////////////////////////////////////////////
+
+// Repeating key xor of a stream fed chunk by chunk, carrying the key phase
+// from one chunk to the next. A single byte key gives single byte xor.
+class XorStream {
+public:
+  explicit XorStream(span<const byte> key, size_t offset = 0)
+      : pattern_(key), position_(offset) {}
+
+  // Xors the next chunk of the stream into out, which may be chunk
+  void feed(span<const byte> chunk, span<byte> out) {
+    pattern_.apply(out, chunk, position_);
+    position_ += chunk.size();
+  }
+
+  // Position in the key stream
+  size_t position() const { return position_; }
+
+private:
+  KeyPattern pattern_;
+  size_t position_;
+};
+
+// Blocks are page aligned, so that the kernel copies whole pages in and out
+static constexpr size_t xor_block_size = 1 << 20;
+
+struct FreeDeleter {
+  void operator()(void *p) const { std::free(p); }
+};
+
+std::unique_ptr<byte[], FreeDeleter> aligned_block() {
+  std::unique_ptr<byte[], FreeDeleter> block(
+      static_cast<byte *>(std::aligned_alloc(4096, xor_block_size)));
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+// Xors in into out with the repeating key and returns the number of bytes
+// written. Memory use is one block, whatever the stream size.
+size_t xor_stream(std::istream &in, std::ostream &out, span<const byte> key) {
+  XorStream stream(key);
+  auto block = aligned_block();
+  auto chars = reinterpret_cast<char *>(block.get());
+  while (in.read(chars, xor_block_size) || in.gcount() > 0) {
+    auto n = static_cast<size_t>(in.gcount());
+    span<byte> chunk(block.get(), n);
+    stream.feed(chunk, chunk);
+    if (!out.write(chars, static_cast<std::streamsize>(n))) {
+      throw std::runtime_error("writing xor stream failed");
+    }
+  }
+  return stream.position();
+}
+
+// Same between file descriptors, with read(2) and write(2)
+size_t xor_stream(int in_fd, int out_fd, span<const byte> key) {
+  XorStream stream(key);
+  auto block = aligned_block();
+  while (true) {
+    auto n = ::read(in_fd, block.get(), xor_block_size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      throw std::runtime_error("read failed");
+    }
+    if (n == 0) {
+      return stream.position();
+    }
+    span<byte> chunk(block.get(), static_cast<size_t>(n));
+    stream.feed(chunk, chunk);
+    for (size_t written = 0; written < chunk.size();) {
+      auto m = ::write(out_fd, chunk.data() + written, chunk.size() - written);
+      if (m == -1 && errno != EINTR) {
+        throw std::runtime_error("write failed");
+      }
+      written += m == -1 ? 0 : static_cast<size_t>(m);
+    }
+  }
+}
+
+// Whether both names refer to the same existing file
+bool is_same_file(std::experimental::string_view filename1,
+                  std::experimental::string_view filename2) {
+  struct stat st1, st2;
+  return ::stat(filename1.data(), &st1) == 0 &&
+         ::stat(filename2.data(), &st2) == 0 && st1.st_dev == st2.st_dev &&
+         st1.st_ino == st2.st_ino;
+}
+
+// Xors the file in_filename into out_filename through shared mappings, so
+// that data only moves between the page cache and the xor kernel. Windows
+// are dropped from both mappings once done, which keeps the resident size
+// constant for files larger than memory. When both names are the same file,
+// which truncating would empty under the input mapping, the output goes to
+// out_filename + ".tmp", with the mode of the file, and is then renamed over
+// it. On error, the output file is removed.
+void xor_file(std::experimental::string_view in_filename,
+              std::experimental::string_view out_filename,
+              span<const byte> key) {
+  static constexpr size_t window_size = 64 << 20;
+  MappedFile input(in_filename);
+  auto in_place = is_same_file(in_filename, out_filename);
+  auto filename = std::string(out_filename) + (in_place ? ".tmp" : "");
+  auto fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("open failed");
+  }
+  auto fail = [&](const char *what) {
+    if (fd != -1) {
+      ::close(fd);
+    }
+    ::unlink(filename.c_str());
+    throw std::runtime_error(what);
+  };
+
+  if (in_place) {
+    struct stat st;
+    if (::stat(in_filename.data(), &st) == -1 ||
+        ::fchmod(fd, st.st_mode & 07777) == -1) {
+      fail("fchmod failed");
+    }
+  }
+
+  if (input.size() > 0) {
+    if (::ftruncate(fd, static_cast<off_t>(input.size())) == -1) {
+      fail("ftruncate failed");
+    }
+    auto data = ::mmap(nullptr, input.size(), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      fail("mmap failed");
+    }
+    ::close(fd);
+    fd = -1;
+
+    auto in = reinterpret_cast<const byte *>(input.text().data());
+    auto out = static_cast<byte *>(data);
+    try {
+      XorStream stream(key);
+      for (size_t i = 0; i < input.size(); i += window_size) {
+        auto n = std::min(window_size, input.size() - i);
+        stream.feed({in + i, n}, {out + i, n});
+        ::madvise(out + i, n, MADV_DONTNEED); // dirty pages stay in the cache
+        ::madvise(const_cast<byte *>(in + i), n, MADV_DONTNEED);
+      }
+    } catch (...) {
+      ::munmap(data, input.size());
+      ::unlink(filename.c_str());
+      throw;
+    }
+    ::munmap(data, input.size());
+  } else {
+    ::close(fd);
+    fd = -1;
+  }
+
+  if (in_place && ::rename(filename.c_str(), out_filename.data()) == -1) {
+    fail("rename failed");
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decrypting xor ciphers
+///////////////////////////////////////////////////////////////////////////////
+
+struct LetterFrequencies {
+  std::array<unsigned int, 26> freqs;
+  unsigned int num_letters;
+};
+
+// Class of each byte: its letter index for either case, or other_printable
+// or unprintable
+static constexpr byte other_printable = 26;
+static constexpr byte unprintable = 27;
+
+constexpr std::array<byte, 256> make_letter_table() {
+  std::array<byte, 256> table{};
+  for (size_t i = 0; i < table.size(); i++) {
+    auto b = static_cast<byte>(i);
+    table[i] = is_lower(b)       ? b - 'a'
+               : is_upper(b)     ? b - 'A'
+               : is_printable(b) ? other_printable
+                                 : unprintable;
+  }
+  return table;
+}
+
+static constexpr auto letter_table = make_letter_table();
+
+// Counts the letters of ciphertext xored with key in a single pass, without
+// materializing the plaintext. With only_printable, returns false as soon as
+// an unprintable byte is found, leaving lf unset.
+template <bool only_printable = true>
+bool count_letters_xored(span<const byte> ciphertext, byte key,
+                         LetterFrequencies &lf) {
+  std::array<unsigned int, 28> counts = {};
+  for (auto c : ciphertext) {
+    auto letter = letter_table[c ^ key];
+    if (only_printable && letter == unprintable) {
+      return false;
+    }
+    counts[letter]++;
+  }
+
+  std::copy(counts.begin(), counts.begin() + 26, lf.freqs.begin());
+  lf.num_letters = static_cast<unsigned int>(ciphertext.size()) -
+                   counts[other_printable] - counts[unprintable];
+  return true;
+}
+
+// Set of single byte keys, one bit per key
+struct KeySet {
+  std::array<uint64_t, 4> words;
+
+  bool contains(byte key) const { return (words[key >> 6] >> (key & 63)) & 1; }
+
+  size_t size() const {
+    size_t n = 0;
+    for (auto w : words) {
+      n += __builtin_popcountll(w);
+    }
+    return n;
+  }
+
+  KeySet &operator&=(const KeySet &other) {
+    for (size_t i = 0; i < words.size(); i++) {
+      words[i] &= other.words[i];
+    }
+    return *this;
+  }
+
+  // Calls f on each key of the set, in ascending order
+  template <typename F> void for_each(F f) const {
+    for (unsigned int i = 0; i < words.size(); i++) {
+      for (auto w = words[i]; w != 0; w &= w - 1) {
+        f(static_cast<byte>(i * 64 + __builtin_ctzll(w)));
+      }
+    }
+  }
+};
+
+static constexpr KeySet all_keys{{~0ull, ~0ull, ~0ull, ~0ull}};
+
+// For each ciphertext byte, the keys that decrypt it to a printable byte
+constexpr std::array<KeySet, 256> make_admissible_keys() {
+  std::array<KeySet, 256> table{};
+  for (size_t c = 0; c < table.size(); c++) {
+    for (size_t key = 0; key < 256; key++) {
+      if (letter_table[c ^ key] != unprintable) {
+        table[c].words[key >> 6] |= 1ull << (key & 63);
+      }
+    }
+  }
+  return table;
+}
+
+static constexpr auto admissible_keys = make_admissible_keys();
+
+// Keys that decrypt every byte of ciphertext to a printable byte
+KeySet printable_keys(span<const byte> ciphertext) {
+  std::array<bool, 256> seen = {};
+  for (auto c : ciphertext) {
+    seen[c] = true;
+  }
+  auto keys = all_keys;
+  for (unsigned int c = 0; c < 256; c++) {
+    if (seen[c]) {
+      keys &= admissible_keys[c];
+    }
+  }
+  return keys;
+}
+
+// Byte histogram of a ciphertext. A single byte xor only relabels bytes, key
+// k moving bin c to c ^ k, so the histogram gives the byte counts of every
+// key without going over the ciphertext again. With a key, the histogram is
+// the one of ciphertext xored with it.
+class XorHistogram {
+public:
+  explicit XorHistogram(span<const byte> ciphertext, byte key = 0)
+      : size_(ciphertext.size()) {
+    for (auto c : ciphertext) {
+      counts_[c ^ key]++;
+    }
+    for (unsigned int c = 0; c < 256; c++) {
+      if (counts_[c] > 0) {
+        present_[num_present_++] = static_cast<byte>(c);
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  // Counts of the ciphertext bytes
+  const std::array<unsigned int, 256> &counts() const { return counts_; }
+
+  // Count of plaintext byte b under key
+  unsigned int count(byte b, byte key) const { return counts_[b ^ key]; }
+
+  // Calls f(b, count) on each plaintext byte b under key with a count
+  template <typename F> void for_each(byte key, F f) const {
+    for (size_t i = 0; i < num_present_; i++) {
+      f(static_cast<byte>(present_[i] ^ key), counts_[present_[i]]);
+    }
+  }
+
+  // Keys that decrypt every byte of the ciphertext to a printable byte
+  KeySet printable_keys() const {
+    auto keys = all_keys;
+    for (size_t i = 0; i < num_present_; i++) {
+      keys &= admissible_keys[present_[i]];
+    }
+    return keys;
+  }
+
+  // Same as count_letters_xored, in O(distinct bytes + letters)
+  template <bool only_printable = true>
+  bool count_letters(byte key, LetterFrequencies &lf) const {
+    if (only_printable) {
+      for (size_t i = 0; i < num_present_; i++) {
+        if (letter_table[present_[i] ^ key] == unprintable) {
+          return false;
+        }
+      }
+    }
+
+    lf.num_letters = 0;
+    for (unsigned int i = 0; i < 26; i++) {
+      lf.freqs[i] = counts_[('a' + i) ^ key] + counts_[('A' + i) ^ key];
+      lf.num_letters += lf.freqs[i];
+    }
+    return true;
+  }
+
+private:
+  size_t size_;
+  std::array<unsigned int, 256> counts_ = {};
+  std::array<byte, 256> present_ = {}; // bytes with a count, ascending
+  size_t num_present_ = 0;
+};
+
+LetterFrequencies count_letters(const std::vector<byte> &byte_vector) {
+  LetterFrequencies lf;
+  count_letters_xored<false>(byte_vector, 0, lf);
+  return lf;
 }
 
-template <class Container> bool is_container_printable(const Container &c) {
-  return std::find_if_not(std::begin(c), std::end(c), is_printable) ==
-         std::end(c);
+static constexpr std::array<double, 26> english_freqs{
+    {0.08167, 0.01492, 0.02782, 0.04253, 0.12702, 0.02228, 0.02015,
+     0.06094, 0.06966, 0.00153, 0.00772, 0.04025, 0.02406, 0.06749,
+     0.07507, 0.01929, 0.00095, 0.05987, 0.06327, 0.09056, 0.02758,
+     0.00978, 0.02360, 0.00150, 0.01974, 0.00074}}; // wikipedia
+
+double chi_squared_statistic(const LetterFrequencies &lf) {
+  double chi_statistic = 0.0;
+  for (auto i = 0; i < 26; i++) {
+    auto o_i = lf.freqs[i];                       // observation
+    auto e_i = lf.num_letters * english_freqs[i]; // expected value
+    chi_statistic += ((o_i - e_i) * (o_i - e_i)) / e_i;
+  }
+
+  return chi_statistic;
 }
 
-namespace base64 {
-static constexpr std::experimental::string_view base64_alphabet(
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", 64);
+double chi_squared_statistic(const std::vector<byte> &byte_vector) {
+  return chi_squared_statistic(count_letters(byte_vector));
+}
 
-constexpr bool is_valid_base64_char(char c) {
-  return is_upper(c) || is_lower(c) || is_digit(c) || c == '+' || c == '/' ||
-         c == '=';
+// Chi-squared statistic of the letter counts in fixed point, for every key
+// of a byte histogram. With o_i the count of letter i under a key, L their
+// sum and r_i = round(2^frac_bits / f_i) the reciprocal of its English
+// frequency, chi = (sum o_i^2 r_i) / (L 2^frac_bits) - L. The sums are
+// computed exactly in integers, with the letter counts of 8 keys in the
+// 32-bit lanes of a vector, so scores are the same on every machine.
+//
+// The kernels set weighted[k] to sum o_i^2 r_i and letters[k] to L for each
+// key k, from 256 counts whose letter counts are at most max_letters.
+namespace fixed_chi {
+
+static constexpr unsigned int frac_bits = 20;
+
+// Keeps o_i^2 in 32 bits, and the weighted sums in 63
+static constexpr unsigned int max_letters = 0xffff;
+
+constexpr std::array<uint32_t, 26> make_reciprocals() {
+  std::array<uint32_t, 26> reciprocals{};
+  for (size_t i = 0; i < reciprocals.size(); i++) {
+    reciprocals[i] =
+        static_cast<uint32_t>((1u << frac_bits) / english_freqs[i] + 0.5);
+  }
+  return reciprocals;
 }
 
-constexpr unsigned int base64_to_int(char c) {
-  assert(is_valid_base64_char(c));
-
-  constexpr auto pos_A = 0;
-  constexpr auto pos_a = 26;
-  constexpr auto pos_0 = 26 + 26;
-
-  if (is_upper(c)) {
-    return pos_A + (c - 'A');
-  } else if (is_lower(c)) {
-    return pos_a + (c - 'a');
-  } else if (is_digit(c)) {
-    return pos_0 + (c - '0');
-  } else if (c == '+') {
-    return 62;
-  } else if (c == '/') {
-    return 63;
-  } else { // ==
-    return 0;
+static constexpr auto reciprocals = make_reciprocals();
+
+void key_sums(const unsigned int *counts, byte key, uint64_t &weighted,
+              uint32_t &letters) {
+  weighted = 0;
+  letters = 0;
+  for (unsigned int i = 0; i < 26; i++) {
+    uint32_t o = counts[('a' + i) ^ key] + counts[('A' + i) ^ key];
+    weighted += uint64_t(o * o) * reciprocals[i];
+    letters += o;
   }
 }
 
-constexpr char int_to_base64(unsigned int i) {
-  assert(0 <= i && i < 64);
+void sums_scalar(const unsigned int *counts, uint64_t *weighted,
+                 uint32_t *letters) {
+  for (unsigned int k = 0; k < 256; k++) {
+    key_sums(counts, static_cast<byte>(k), weighted[k], letters[k]);
+  }
+}
+
+#ifdef CRYPTOPALS_X86
+// For keys k0 ^ j, j < 8, the counts of byte c are the aligned block of 8
+// counts holding c ^ k0, permuted by j ^ (c ^ k0) % 8. Squares are widened
+// to 64 bits by multiplying the even and the odd lanes apart.
+TARGET_AVX2 inline __m256i permuted_block(const unsigned int *counts,
+                                          unsigned int c) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return _mm256_permutevar8x32_epi32(
+      simd::load256(counts + (c & ~7u)),
+      _mm256_xor_si256(lanes, _mm256_set1_epi32(static_cast<int>(c & 7))));
+}
 
-  return base64_alphabet[i];
+TARGET_AVX2 void sums_avx2(const unsigned int *counts, uint64_t *weighted,
+                           uint32_t *letters) {
+  for (unsigned int k0 = 0; k0 < 256; k0 += 8) {
+    __m256i even = _mm256_setzero_si256();
+    __m256i odd = _mm256_setzero_si256();
+    __m256i total = _mm256_setzero_si256();
+    for (unsigned int i = 0; i < 26; i++) {
+      auto o = _mm256_add_epi32(permuted_block(counts, ('a' + i) ^ k0),
+                                permuted_block(counts, ('A' + i) ^ k0));
+      auto square = _mm256_mullo_epi32(o, o);
+      auto r = _mm256_set1_epi32(static_cast<int>(reciprocals[i]));
+      even = _mm256_add_epi64(even, _mm256_mul_epu32(square, r));
+      odd = _mm256_add_epi64(
+          odd, _mm256_mul_epu32(_mm256_srli_epi64(square, 32), r));
+      total = _mm256_add_epi32(total, o);
+    }
+    simd::store256(letters + k0, total);
+
+    alignas(32) std::array<uint64_t, 4> even_sums;
+    alignas(32) std::array<uint64_t, 4> odd_sums;
+    simd::store256(even_sums.data(), even);
+    simd::store256(odd_sums.data(), odd);
+    for (unsigned int j = 0; j < 4; j++) {
+      weighted[k0 + 2 * j] = even_sums[j];
+      weighted[k0 + 2 * j + 1] = odd_sums[j];
+    }
+  }
 }
+#endif
+
+void sums(const unsigned int *counts, uint64_t *weighted, uint32_t *letters) {
+#ifdef CRYPTOPALS_X86
+  static const auto kernel =
+      simd::pick(sums_scalar, sums_scalar, sums_avx2, sums_avx2);
+  kernel(counts, weighted, letters);
+#else
+  sums_scalar(counts, weighted, letters);
+#endif
 }
 
-enum class Encoding { hex, ascii, base64 };
+// Score of the sums, chi in units of 2^-frac_bits, or the maximum without
+// letters
+int64_t score(uint64_t weighted, uint32_t letters) {
+  if (letters == 0) {
+    return std::numeric_limits<int64_t>::max();
+  }
+  return static_cast<int64_t>(weighted / letters) -
+         (static_cast<int64_t>(letters) << frac_bits);
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// Byte vector functions
-///////////////////////////////////////////////////////////////////////////////
+// Histogram of n bytes scaled down so that letter counts are at most
+// max_letters
+std::array<unsigned int, 256>
+scaled_counts(const std::array<unsigned int, 256> &counts, size_t n) {
+  unsigned int shift = 0;
+  while ((n >> shift) > max_letters) {
+    shift++;
+  }
+  auto scaled = counts;
+  for (auto &count : scaled) {
+    count >>= shift;
+  }
+  return scaled;
+}
 
-std::vector<byte> string_to_bytes(std::experimental::string_view s,
-                                  Encoding mode = Encoding::hex) {
-  std::vector<byte> byte_vector;
+} // namespace fixed_chi
+
+// Scoring models for the xor breakers, passed as the Scorer template
+// parameter. Each has a static score(counts, key) of the plaintext under key,
+// lower meaning closer to English, where counts is a Scorer::Counts of the
+// ciphertext: an XorHistogram, or anything that relabels under a key the
+// same way and gives its printable_keys.
+namespace scorer {
+
+// English byte model: shares of letters, spaces and other printable bytes,
+// letters split by case, and a floor for unprintable bytes
+static constexpr double letter_share = 0.80;
+static constexpr double space_share = 0.15;
+static constexpr double other_share = 0.05;
+static constexpr double upper_share = 0.03; // of letters
+static constexpr double unprintable_freq = 1e-6;
+
+constexpr std::array<double, 256> make_english_byte_freqs() {
+  std::array<double, 256> freqs{};
+  unsigned int num_other = 0;
+  for (size_t i = 0; i < freqs.size(); i++) {
+    auto b = static_cast<byte>(i);
+    num_other += is_printable(b) && letter_table[b] == other_printable &&
+                 b != ' ';
+  }
+  double sum = 0.0;
+  for (size_t i = 0; i < freqs.size(); i++) {
+    auto b = static_cast<byte>(i);
+    auto letter = letter_table[b];
+    auto case_share = is_upper(b) ? upper_share : 1 - upper_share;
+    freqs[i] = b == ' '                    ? space_share
+               : letter == unprintable     ? unprintable_freq
+               : letter == other_printable ? other_share / num_other
+                                           : letter_share * case_share *
+                                                 english_freqs[letter];
+    sum += freqs[i];
+  }
+  for (auto &f : freqs) {
+    f /= sum;
+  }
+  return freqs;
+}
 
-  switch (mode) {
-  case Encoding::hex: {
-    assert(s.size() % 2 == 0); // 2 hex digits per 1 byte
-    byte_vector.reserve(s.size() / 2);
-    for (size_t i = 0; i < s.size(); i += 2) {
-      byte_vector.push_back(stoi(std::string(s.substr(i, 2)), nullptr, 16));
+static constexpr auto english_byte_freqs = make_english_byte_freqs();
+
+std::array<double, 256> make_english_byte_log_freqs() {
+  std::array<double, 256> log_freqs;
+  std::transform(english_byte_freqs.begin(), english_byte_freqs.end(),
+                 log_freqs.begin(), [](double f) { return std::log(f); });
+  return log_freqs;
+}
+
+// Built on first use, as std::log is not constexpr
+const std::array<double, 256> &english_byte_log_freqs() {
+  static const auto log_freqs = make_english_byte_log_freqs();
+  return log_freqs;
+}
+
+// Chi-squared statistic of the case-folded letter counts against English.
+// Blind to everything but letters, so keys differing by 0x20 tie.
+struct ChiSquared {
+  using Counts = XorHistogram;
+
+  static double score(const XorHistogram &histogram, byte key) {
+    LetterFrequencies lf;
+    histogram.count_letters<false>(key, lf);
+    return chi_squared_statistic(lf);
+  }
+
+  // Same score in a pass over ciphertext, for the per-key search
+  static double score_xored(span<const byte> ciphertext, byte key) {
+    LetterFrequencies lf;
+    count_letters_xored<false>(ciphertext, key, lf);
+    return chi_squared_statistic(lf);
+  }
+};
+
+// Negative log-likelihood per byte of the plaintext under the English byte
+// model
+struct LogLikelihood {
+  using Counts = XorHistogram;
+
+  static double score(const XorHistogram &histogram, byte key) {
+    if (histogram.size() == 0) {
+      return 0.0;
     }
-    break;
+    const auto &log_freqs = english_byte_log_freqs();
+    double log_likelihood = 0.0;
+    histogram.for_each(key, [&](byte b, unsigned int count) {
+      log_likelihood += count * log_freqs[b];
+    });
+    return -log_likelihood / histogram.size();
   }
-  case Encoding::ascii: {
-    byte_vector.reserve(s.size());
-    std::copy(s.begin(), s.end(), std::back_inserter(byte_vector));
-    break;
+};
+
+// Chi-squared statistic over all 256 byte values against the English byte
+// model. Since the model sums to 1, absent bytes need not be visited:
+// sum (o - e)^2 / e = sum o^2 / e - n.
+struct FullByte {
+  using Counts = XorHistogram;
+
+  static double score(const XorHistogram &histogram, byte key) {
+    double n = histogram.size();
+    if (n == 0) {
+      return 0.0;
+    }
+    double chi_statistic = 0.0;
+    histogram.for_each(key, [&](byte b, unsigned int count) {
+      chi_statistic += double(count) * count / (n * english_byte_freqs[b]);
+    });
+    return chi_statistic - n;
   }
-  case Encoding::base64: {
-    assert(s.size() % 4 == 0); // 4 base64 chars per 3 bytes
-    byte_vector.reserve((s.size() / 4) * 3);
+};
 
-    for (auto str_it = s.begin(); str_it != s.end(); str_it += 4) {
-      std::array<std::string, 4> binary_array;
-      std::transform(str_it, str_it + 4, binary_array.begin(), [](char c) {
-        return std::bitset<6>(base64::base64_to_int(c)).to_string();
-      });
+// Chi-squared statistic of the letters like ChiSquared, in fixed point and
+// for all keys at once: scores are reproducible bit for bit, so that equal
+// statistics always tie and are ordered by key
+struct FixedChiSquared {
+  using Counts = XorHistogram;
+
+  static double score(const XorHistogram &histogram, byte key) {
+    auto counts =
+        fixed_chi::scaled_counts(histogram.counts(), histogram.size());
+    uint64_t weighted;
+    uint32_t letters;
+    fixed_chi::key_sums(counts.data(), key, weighted, letters);
+    return to_double(fixed_chi::score(weighted, letters));
+  }
 
-      std::string binary_string;
-      binary_string.reserve(24); // 4 base64 chars, each one 6 bits
-      binary_string = std::accumulate(begin(binary_array), end(binary_array),
-                                      binary_string);
+  static void score_all(const XorHistogram &histogram,
+                        std::array<double, 256> &scores) {
+    auto counts =
+        fixed_chi::scaled_counts(histogram.counts(), histogram.size());
+    std::array<uint64_t, 256> weighted;
+    std::array<uint32_t, 256> letters;
+    fixed_chi::sums(counts.data(), weighted.data(), letters.data());
+    for (unsigned int k = 0; k < 256; k++) {
+      scores[k] = to_double(fixed_chi::score(weighted[k], letters[k]));
+    }
+  }
 
-      for (size_t i = 0; i < binary_string.size(); i += 8) {
-        byte_vector.push_back(stoi(binary_string.substr(i, 8), nullptr, 2));
-      }
+private:
+  static double to_double(int64_t score) {
+    return score == std::numeric_limits<int64_t>::max()
+               ? std::numeric_limits<double>::max()
+               : std::ldexp(double(score), -int(fixed_chi::frac_bits));
+  }
+};
+
+// Chi-squared statistic over the case-folded letters, the space and all
+// other bytes, against the shares of the English byte model
+struct SpaceAware {
+  using Counts = XorHistogram;
+
+  static double score(const XorHistogram &histogram, byte key) {
+    double n = histogram.size();
+    if (n == 0) {
+      return 0.0;
+    }
+    LetterFrequencies lf;
+    histogram.count_letters<false>(key, lf);
+    auto spaces = histogram.count(' ', key);
+
+    auto term = [](double o, double e) { return (o - e) * (o - e) / e; };
+    double chi_statistic = 0.0;
+    for (auto i = 0; i < 26; i++) {
+      chi_statistic += term(lf.freqs[i], n * letter_share * english_freqs[i]);
     }
+    chi_statistic += term(spaces, n * space_share);
+    chi_statistic += term(n - lf.num_letters - spaces, n * other_share);
+    return chi_statistic;
+  }
+};
 
-    break;
+} // namespace scorer
+
+// Byte n-gram model with costs quantized to bytes, the cost of probability p
+// being round(-ln(p) * cost_scale) capped at 255. Bigram costs are those of
+// the second byte given the first, at [first << 8 | second], 64 KB in all.
+// Trigram costs, of the third byte given the first two, are kept for a set
+// of trigrams only, behind a perfect hash: trigram t is in the slot given by
+// the trigram hash of t xored with the displacement of the bucket of t, and
+// the slot holds t << 8 | cost. Every 32-bit value is an entry, so empty
+// slots hold the trigram FF FF FF at its bigram cost, which is what a lookup
+// of it falls back to: hitting an empty slot gives the right cost anyway.
+struct NGramModel {
+  double cost_scale;
+  const uint8_t *unigram_costs;
+  const uint8_t *bigram_costs;
+  const uint32_t *trigram_slots;          // 1 << trigram_bits
+  const uint16_t *trigram_displacements;  // 1 << bucket_bits
+  uint32_t trigram_multiplier;
+  uint32_t bucket_multiplier;
+  unsigned int trigram_bits;
+  unsigned int bucket_bits;
+
+  unsigned int bigram_cost(byte a, byte b) const {
+    return bigram_costs[a << 8 | b];
+  }
+
+  size_t trigram_slot(uint32_t t) const {
+    auto bucket = (t * bucket_multiplier) >> (32 - bucket_bits);
+    return ((t * trigram_multiplier) >> (32 - trigram_bits)) ^
+           trigram_displacements[bucket];
   }
+
+  // Cost of c after a and b: its trigram cost if kept, else its bigram cost
+  unsigned int trigram_cost(uint32_t t) const {
+    auto slot = trigram_slots[trigram_slot(t)];
+    return (slot >> 8) == t ? slot & 0xff : bigram_cost((t >> 8) & 0xff, t);
   }
 
-  return byte_vector;
+  uint32_t empty_trigram_slot() const {
+    return 0xffffffu << 8 | bigram_cost(0xff, 0xff);
+  }
+};
+
+// Displacements are 16 bits
+static constexpr unsigned int max_trigram_bits = 16;
+
+uint8_t quantize_cost(double p, double cost_scale) {
+  auto cost = std::round(-std::log(p) * cost_scale);
+  return static_cast<uint8_t>(std::min(std::max(cost, 0.0), 255.0));
 }
 
-std::string bytes_to_string(const std::vector<byte> &byte_vector,
-                            Encoding mode = Encoding::hex) {
-  std::string s;
+// Owner of the tables of an NGramModel, quantized from probabilities: the
+// unigram ones, the bigram ones of each byte given the one before, and the
+// trigram ones of the kept trigrams given their first two bytes
+class NGramTables {
+public:
+  NGramTables(double cost_scale, const std::array<double, 256> &unigrams,
+              const std::vector<double> &bigrams,
+              const std::vector<std::pair<uint32_t, double>> &trigrams)
+      : bigram_costs_(256 * 256) {
+    if (2 * trigrams.size() > (size_t(1) << max_trigram_bits)) {
+      throw std::invalid_argument("too many trigrams");
+    }
+    for (unsigned int b = 0; b < 256; b++) {
+      unigram_costs_[b] = quantize_cost(unigrams[b], cost_scale);
+    }
+    for (size_t i = 0; i < bigram_costs_.size(); i++) {
+      bigram_costs_[i] = quantize_cost(bigrams[i], cost_scale);
+    }
+    std::vector<uint32_t> entries;
+    for (const auto &trigram : trigrams) {
+      entries.push_back(trigram.first << 8 |
+                        quantize_cost(trigram.second, cost_scale));
+    }
+    model_.cost_scale = cost_scale;
+    make_trigram_slots(entries);
+    point_model();
+  }
 
-  switch (mode) {
-  case Encoding::hex: {
-    std::stringstream ss;
-    ss << std::hex;
-    for_each(byte_vector.begin(), byte_vector.end(),
-             [&ss](byte b) { ss << static_cast<short int>(b); });
-    s = ss.str();
-    break;
+  NGramTables(const NGramTables &other)
+      : unigram_costs_(other.unigram_costs_),
+        bigram_costs_(other.bigram_costs_),
+        trigram_slots_(other.trigram_slots_),
+        trigram_displacements_(other.trigram_displacements_),
+        model_(other.model_) {
+    point_model();
   }
-  case Encoding::ascii: {
-    s.reserve(byte_vector.size());
-    std::copy(byte_vector.begin(), byte_vector.end(), std::back_inserter(s));
-    break;
+  NGramTables &operator=(const NGramTables &) = delete;
+
+  const NGramModel &model() const { return model_; }
+
+private:
+  void point_model() {
+    model_.unigram_costs = unigram_costs_.data();
+    model_.bigram_costs = bigram_costs_.data();
+    model_.trigram_slots = trigram_slots_.data();
+    model_.trigram_displacements = trigram_displacements_.data();
   }
-  case Encoding::base64: {
-    assert(byte_vector.size() % 3 == 0); // 3 bytes per 4 base64 chars
-    s.reserve((byte_vector.size() / 3) * 4);
 
-    for (auto it = byte_vector.begin(); it != byte_vector.end(); it += 3) {
-      std::array<std::string, 3> binary_array;
-      std::transform(it, it + 3, binary_array.begin(),
-                     [](byte b) { return std::bitset<8>(b).to_string(); });
+  // Hash and displace: the trigrams are spread in buckets of about four, and
+  // from the largest bucket on, each bucket gets the first displacement
+  // moving all its trigrams to free slots. Multipliers come from a fixed
+  // sequence, so the same trigrams always give the same tables. After 64
+  // failed attempts the table doubles, up to max_trigram_bits.
+  void make_trigram_slots(const std::vector<uint32_t> &entries) {
+    auto &bits = model_.trigram_bits;
+    auto &bucket_bits = model_.bucket_bits;
+    bits = 1;
+    while ((size_t(1) << bits) < 2 * entries.size()) {
+      bits++;
+    }
+    bucket_bits = 1;
+    while ((size_t(4) << bucket_bits) < entries.size()) {
+      bucket_bits++;
+    }
 
-      std::string binary_string;
-      binary_string.reserve(24); // 3 bytes, each one 8 bits
-      binary_string = std::accumulate(begin(binary_array), end(binary_array),
-                                      binary_string);
+    uint32_t state = 0x9e3779b9;
+    auto next_multiplier = [&] {
+      state = state * 1664525 + 1013904223;
+      return state | 1;
+    };
+    for (;; bits++) {
+      for (unsigned int attempt = 0; attempt < 64; attempt++) {
+        model_.trigram_multiplier = next_multiplier();
+        model_.bucket_multiplier = next_multiplier();
+        if (place_trigrams(entries)) {
+          return;
+        }
+      }
+      if (bits == max_trigram_bits) {
+        throw std::runtime_error("no perfect hash of the trigrams found");
+      }
+    }
+  }
 
-      for (size_t i = 0; i < binary_string.size(); i += 6) {
-        s.push_back(base64::int_to_base64(
-            stoi(binary_string.substr(i, 6), nullptr, 2)));
+  bool place_trigrams(const std::vector<uint32_t> &entries) {
+    const auto &m = model_;
+    std::vector<std::vector<uint32_t>> buckets(size_t(1) << m.bucket_bits);
+    for (auto entry : entries) {
+      auto t = entry >> 8;
+      buckets[(t * m.bucket_multiplier) >> (32 - m.bucket_bits)].push_back(
+          entry);
+    }
+    std::vector<size_t> order(buckets.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+
+    size_t num_slots = size_t(1) << m.trigram_bits;
+    point_model(); // for the bigram cost of the empty slots
+    trigram_slots_.assign(num_slots, m.empty_trigram_slot());
+    std::vector<bool> occupied(num_slots);
+    trigram_displacements_.assign(buckets.size(), 0);
+    std::vector<size_t> slots;
+    for (auto bucket : order) {
+      if (buckets[bucket].empty()) {
+        break;
+      }
+      bool placed = false;
+      for (size_t d = 0; d < num_slots && !placed; d++) {
+        slots.clear();
+        placed = true;
+        for (auto entry : buckets[bucket]) {
+          auto slot =
+              (((entry >> 8) * m.trigram_multiplier) >> (32 - m.trigram_bits)) ^
+              d;
+          if (occupied[slot] ||
+              std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+            placed = false;
+            break;
+          }
+          slots.push_back(slot);
+        }
+        if (placed) {
+          trigram_displacements_[bucket] = static_cast<uint16_t>(d);
+          for (size_t i = 0; i < slots.size(); i++) {
+            trigram_slots_[slots[i]] = buckets[bucket][i];
+            occupied[slots[i]] = true;
+          }
+        }
+      }
+      if (!placed) {
+        return false;
       }
     }
+    return true;
+  }
 
-    if (s.back() == 'A') { // padding whp
-      s.back() = '=';
+  std::array<uint8_t, 256> unigram_costs_;
+  std::vector<uint8_t> bigram_costs_;
+  std::vector<uint32_t> trigram_slots_;
+  std::vector<uint16_t> trigram_displacements_;
+  NGramModel model_ = {};
+};
+
+// Most frequent letter bigrams and trigrams of English, in percent of all
+// letter bigrams and trigrams (Norvig, "English Letter Frequency Counts:
+// Mayzner Revisited")
+static constexpr std::pair<const char *, double> english_bigrams[] = {
+    {"th", 3.56}, {"he", 3.07}, {"in", 2.43}, {"er", 2.05}, {"an", 1.99},
+    {"re", 1.85}, {"on", 1.76}, {"at", 1.49}, {"en", 1.45}, {"nd", 1.35},
+    {"ti", 1.34}, {"es", 1.34}, {"or", 1.28}, {"te", 1.20}, {"of", 1.17},
+    {"ed", 1.17}, {"is", 1.13}, {"it", 1.12}, {"al", 1.09}, {"ar", 1.07},
+    {"st", 1.05}, {"to", 1.04}, {"nt", 1.04}, {"ng", 0.95}, {"se", 0.93},
+    {"ha", 0.93}, {"as", 0.87}, {"ou", 0.87}, {"io", 0.83}, {"le", 0.83},
+    {"ve", 0.83}, {"co", 0.79}, {"me", 0.79}, {"de", 0.76}, {"hi", 0.76},
+    {"ri", 0.73}, {"ro", 0.73}, {"ic", 0.70}, {"ne", 0.69}, {"ea", 0.69},
+    {"ra", 0.69}, {"ce", 0.65}, {"li", 0.62}, {"ch", 0.60}, {"ll", 0.58},
+    {"be", 0.58}, {"ma", 0.57}, {"si", 0.55}, {"om", 0.55}, {"ur", 0.54}};
+
+static constexpr std::pair<const char *, double> english_trigrams[] = {
+    {"the", 1.81}, {"and", 0.73}, {"ing", 0.72}, {"ent", 0.42},
+    {"ion", 0.42}, {"her", 0.36}, {"for", 0.34}, {"tha", 0.33},
+    {"nth", 0.33}, {"int", 0.32}, {"ere", 0.31}, {"tio", 0.31},
+    {"ter", 0.30}, {"est", 0.28}, {"ers", 0.28}, {"ati", 0.26},
+    {"hat", 0.26}, {"ate", 0.25}, {"all", 0.25}, {"eth", 0.24},
+    {"hes", 0.24}, {"ver", 0.24}, {"his", 0.24}, {"oft", 0.22},
+    {"ith", 0.21}, {"fth", 0.21}, {"sth", 0.21}, {"oth", 0.21},
+    {"res", 0.21}, {"ont", 0.20}};
+
+// Built-in English n-gram model. Letter pairs follow the bigram list above,
+// the unlisted ones sharing the rest of the letter pair mass in proportion
+// to their letter frequencies, and other byte pairs follow the English byte
+// model as if independent, bar runs of spaces which are made rare.
+NGramTables make_english_ngrams() {
+  static constexpr double cost_scale = 8.0;
+  static constexpr double space_run_ratio = 0.01;
+
+  std::array<double, 26 * 26> letter_pairs{};
+  double listed = 0.0;
+  double listed_independent = 0.0;
+  for (const auto &bigram : english_bigrams) {
+    auto i = bigram.first[0] - 'a';
+    auto j = bigram.first[1] - 'a';
+    letter_pairs[i * 26 + j] = bigram.second / 100;
+    listed += bigram.second / 100;
+    listed_independent += english_freqs[i] * english_freqs[j];
+  }
+  for (unsigned int i = 0; i < 26; i++) {
+    for (unsigned int j = 0; j < 26; j++) {
+      if (letter_pairs[i * 26 + j] == 0.0) {
+        letter_pairs[i * 26 + j] = (1 - listed) * english_freqs[i] *
+                                   english_freqs[j] / (1 - listed_independent);
+      }
     }
+  }
 
-    break;
+  const auto &freqs = scorer::english_byte_freqs;
+  std::vector<double> bigrams(256 * 256);
+  for (unsigned int a = 0; a < 256; a++) {
+    double row_sum = 0.0;
+    for (unsigned int b = 0; b < 256; b++) {
+      auto i = letter_table[a];
+      auto j = letter_table[b];
+      double ratio = 1.0;
+      if (i < 26 && j < 26) {
+        ratio =
+            letter_pairs[i * 26 + j] / (english_freqs[i] * english_freqs[j]);
+      } else if (a == ' ' && b == ' ') {
+        ratio = space_run_ratio;
+      }
+      bigrams[a << 8 | b] = freqs[a] * freqs[b] * ratio;
+      row_sum += bigrams[a << 8 | b];
+    }
+    for (unsigned int b = 0; b < 256; b++) {
+      bigrams[a << 8 | b] /= row_sum;
+    }
   }
+
+  std::vector<std::pair<uint32_t, double>> trigrams;
+  for (const auto &trigram : english_trigrams) {
+    auto i = trigram.first[0] - 'a';
+    auto j = trigram.first[1] - 'a';
+    uint32_t t = byte(trigram.first[0]) << 16 | byte(trigram.first[1]) << 8 |
+                 byte(trigram.first[2]);
+    trigrams.emplace_back(
+        t, std::min(trigram.second / 100 / letter_pairs[i * 26 + j], 1.0));
   }
 
-  return s;
+  return NGramTables(cost_scale, freqs, bigrams, trigrams);
 }
 
-std::ostream &operator<<(std::ostream &stream,
-                         const std::vector<byte> &byte_vector) {
-  stream << bytes_to_string(byte_vector, Encoding::ascii);
-  return stream;
+const NGramModel &english_ngrams() {
+  static const auto english = make_english_ngrams();
+  return english.model();
 }
 
-std::vector<byte> file_to_bytes(std::experimental::string_view filename,
-                                Encoding mode = Encoding::hex) {
-  std::string filetext;
-  std::ifstream infile(filename.data());
-  std::copy_if(std::istreambuf_iterator<char>{infile},
-               std::istreambuf_iterator<char>{}, std::back_inserter(filetext),
-               [](auto c) { return c != '\n'; });
+// N-gram counts of a corpus, over all byte values. Trigrams are kept sparse.
+struct NGramCounts {
+  uint64_t size = 0;
+  std::vector<uint64_t> unigrams = std::vector<uint64_t>(256);
+  std::vector<uint64_t> bigrams = std::vector<uint64_t>(256 * 256);
+  std::unordered_map<uint32_t, uint64_t> trigrams;
+
+  // Counts the n-grams of text, or of those starting in [first, last) of it
+  void add(span<const byte> text, size_t first, size_t last) {
+    size += last - first;
+    for (size_t i = first; i < last; i++) {
+      unigrams[text[i]]++;
+      if (i + 1 < text.size()) {
+        bigrams[text[i] << 8 | text[i + 1]]++;
+      }
+      if (i + 2 < text.size()) {
+        trigrams[uint32_t(text[i]) << 16 | uint32_t(text[i + 1]) << 8 |
+                 text[i + 2]]++;
+      }
+    }
+  }
+
+  void merge(const NGramCounts &other) {
+    size += other.size;
+    for (size_t i = 0; i < unigrams.size(); i++) {
+      unigrams[i] += other.unigrams[i];
+    }
+    for (size_t i = 0; i < bigrams.size(); i++) {
+      bigrams[i] += other.bigrams[i];
+    }
+    for (const auto &trigram : other.trigrams) {
+      trigrams[trigram.first] += trigram.second;
+    }
+  }
+};
 
-  return string_to_bytes(filetext, mode);
+// Counts the n-grams of text with num_threads threads, each one counting
+// the n-grams starting in its slice of text
+NGramCounts count_ngrams(span<const byte> text,
+                         unsigned int num_threads = default_num_threads()) {
+  static constexpr size_t min_slice_size = 1 << 20;
+  num_threads = static_cast<unsigned int>(std::max<size_t>(
+      1, std::min<size_t>(num_threads, text.size() / min_slice_size)));
+
+  std::vector<NGramCounts> counts(num_threads);
+  run_parallel(num_threads, [&](unsigned int k) {
+    counts[k].add(text, text.size() * k / num_threads,
+                  text.size() * (k + 1) / num_threads);
+  });
+  for (unsigned int k = 1; k < num_threads; k++) {
+    counts[0].merge(counts[k]);
+  }
+  return std::move(counts[0]);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Xor functions
-///////////////////////////////////////////////////////////////////////////////
+// Model of counts: unigram and bigram probabilities with add-half smoothing
+// toward the uniform and unigram distributions, and the num_trigrams most
+// frequent trigrams, smoothed toward their bigram probability
+NGramTables train_ngrams(const NGramCounts &counts,
+                         size_t num_trigrams = 4096,
+                         double cost_scale = 8.0) {
+  static constexpr double alpha = 0.5;
+
+  std::array<double, 256> unigrams;
+  for (unsigned int b = 0; b < 256; b++) {
+    unigrams[b] = (counts.unigrams[b] + alpha) / (counts.size + 256 * alpha);
+  }
 
-std::vector<byte> fixed_xor(const std::vector<byte> &lhs,
-                            const std::vector<byte> &rhs) {
-  assert(lhs.size() == rhs.size());
+  std::vector<double> bigrams(256 * 256);
+  for (unsigned int a = 0; a < 256; a++) {
+    uint64_t row_count = 0;
+    for (unsigned int b = 0; b < 256; b++) {
+      row_count += counts.bigrams[a << 8 | b];
+    }
+    for (unsigned int b = 0; b < 256; b++) {
+      bigrams[a << 8 | b] =
+          (counts.bigrams[a << 8 | b] + alpha * unigrams[b]) /
+          (row_count + alpha);
+    }
+  }
 
-  std::vector<byte> result;
-  result.reserve(lhs.size());
-  std::transform(lhs.begin(), lhs.end(), rhs.begin(),
-                 std::back_inserter(result), std::bit_xor<byte>());
-  return result;
+  // most frequent first, ties broken by trigram for reproducible models
+  std::vector<std::pair<uint32_t, uint64_t>> kept(counts.trigrams.begin(),
+                                                  counts.trigrams.end());
+  auto more_frequent = [](const auto &x, const auto &y) {
+    return x.second != y.second ? x.second > y.second : x.first < y.first;
+  };
+  num_trigrams = std::min(num_trigrams, kept.size());
+  std::partial_sort(kept.begin(), kept.begin() + num_trigrams, kept.end(),
+                    more_frequent);
+  kept.resize(num_trigrams);
+
+  std::vector<std::pair<uint32_t, double>> trigrams;
+  for (const auto &trigram : kept) {
+    auto t = trigram.first;
+    auto pair_count = counts.bigrams[t >> 8];
+    auto bigram = bigrams[t & 0xffff];
+    trigrams.emplace_back(
+        t, (trigram.second + alpha * bigram) / (pair_count + alpha));
+  }
+
+  return NGramTables(cost_scale, unigrams, bigrams, trigrams);
 }
 
-std::vector<byte> single_byte_xor(const std::vector<byte> &lhs, byte rhs) {
+// A model file holds the tables of an NGramModel as they are in memory, so
+// that mapping the file loads the model. It starts with an NGramFileHeader,
+// followed by the 256 unigram costs, the 64 KB of bigram costs, the trigram
+// slots and the trigram displacements.
+
+struct NGramFileHeader {
+  std::array<char, 8> magic;
+  double cost_scale;
+  uint32_t trigram_multiplier;
+  uint32_t bucket_multiplier;
+  uint32_t trigram_bits;
+  uint32_t bucket_bits;
+  uint64_t corpus_size;
+};
 
-  std::vector<byte> result;
-  result.reserve(lhs.size());
-  std::transform(lhs.begin(), lhs.end(), std::back_inserter(result),
-                 [rhs](byte b) { return b ^ rhs; });
-  return result;
+static constexpr std::array<char, 8> ngram_file_magic{
+    {'N', 'G', 'R', 'M', 'v', '2', 0, 0}};
+
+// Sizes of the tables following the header, in bytes
+std::array<size_t, 4> ngram_table_sizes(const NGramFileHeader &header) {
+  return {{256, 256 * 256, sizeof(uint32_t) << header.trigram_bits,
+           sizeof(uint16_t) << header.bucket_bits}};
 }
 
-std::vector<byte> repeating_key_xor(const std::vector<byte> &lhs,
-                                    const std::vector<byte> &rhs) {
-  assert(lhs.size() >= rhs.size());
+void write_ngram_model(std::experimental::string_view filename,
+                       const NGramModel &model, uint64_t corpus_size = 0) {
+  NGramFileHeader header{ngram_file_magic,        model.cost_scale,
+                         model.trigram_multiplier, model.bucket_multiplier,
+                         model.trigram_bits,       model.bucket_bits,
+                         corpus_size};
+  auto sizes = ngram_table_sizes(header);
+  std::array<const void *, 4> tables{
+      {model.unigram_costs, model.bigram_costs, model.trigram_slots,
+       model.trigram_displacements}};
+
+  std::ofstream output(filename.data(), std::ios::binary);
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (size_t i = 0; i < tables.size(); i++) {
+    output.write(static_cast<const char *>(tables[i]), sizes[i]);
+  }
+  if (!output) {
+    throw std::runtime_error("writing model file failed");
+  }
+}
 
-  std::vector<byte> result = lhs;
+// Memory-mapped model file, whose tables are used in place
+class MappedNGramModel {
+public:
+  explicit MappedNGramModel(std::experimental::string_view filename)
+      : file_(filename) {
+    auto text = file_.text();
+    if (text.size() < sizeof(header_)) {
+      throw std::runtime_error("invalid model file");
+    }
+    std::memcpy(&header_, text.data(), sizeof(header_));
+    // scores divide by cost_scale
+    if (header_.magic != ngram_file_magic ||
+        !std::isfinite(header_.cost_scale) || header_.cost_scale <= 0 ||
+        header_.trigram_bits < 1 || header_.trigram_bits > max_trigram_bits ||
+        header_.bucket_bits < 1 ||
+        header_.bucket_bits > header_.trigram_bits) {
+      throw std::runtime_error("invalid model file");
+    }
+    auto sizes = ngram_table_sizes(header_);
+    if (text.size() !=
+        sizeof(header_) + std::accumulate(sizes.begin(), sizes.end(),
+                                          size_t(0))) {
+      throw std::runtime_error("invalid model file");
+    }
 
-  auto rhs_it = rhs.begin();
-  for (auto &b : result) {
-    b ^= *rhs_it;
-    rhs_it = (rhs_it == rhs.end() - 1) ? rhs.begin() : rhs_it + 1;
+    auto table = text.data() + sizeof(header_);
+    model_.cost_scale = header_.cost_scale;
+    model_.unigram_costs = reinterpret_cast<const uint8_t *>(table);
+    model_.bigram_costs = reinterpret_cast<const uint8_t *>(table += sizes[0]);
+    model_.trigram_slots =
+        reinterpret_cast<const uint32_t *>(table += sizes[1]);
+    model_.trigram_displacements =
+        reinterpret_cast<const uint16_t *>(table += sizes[2]);
+    model_.trigram_multiplier = header_.trigram_multiplier;
+    model_.bucket_multiplier = header_.bucket_multiplier;
+    model_.trigram_bits = header_.trigram_bits;
+    model_.bucket_bits = header_.bucket_bits;
+
+    // a displaced slot must stay in the trigram table
+    auto displacements = model_.trigram_displacements;
+    if (std::any_of(displacements, displacements + (1u << model_.bucket_bits),
+                    [&](uint16_t d) { return d >> model_.trigram_bits; })) {
+      throw std::runtime_error("invalid model file");
+    }
   }
 
-  return result;
+  const NGramFileHeader &header() const { return header_; }
+  const NGramModel &model() const { return model_; }
+
+private:
+  MappedFile file_;
+  NGramFileHeader header_;
+  NGramModel model_ = {};
+};
+
+// Model of the file named by the CRYPTOPALS_NGRAM_MODEL environment
+// variable, mapped on first use, or the built-in English model without it
+const NGramModel &default_ngrams() {
+  static const auto model = []() -> std::unique_ptr<MappedNGramModel> {
+    auto filename = std::getenv("CRYPTOPALS_NGRAM_MODEL");
+    if (filename == nullptr || *filename == '\0') {
+      return nullptr;
+    }
+    return std::unique_ptr<MappedNGramModel>(new MappedNGramModel(filename));
+  }();
+  return model ? model->model() : english_ngrams();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Decrypting xor ciphers
-///////////////////////////////////////////////////////////////////////////////
+// Total cost of ciphertext xored with key under model, in model cost units.
+// The trigrams are read straight from the ciphertext, so that scoring a key
+// needs no buffer.
+unsigned long ngram_cost(const NGramModel &model, span<const byte> ciphertext,
+                         byte key) {
+  auto n = ciphertext.size();
+  if (n == 0) {
+    return 0;
+  }
+  auto c = ciphertext.data();
+  unsigned long cost = model.unigram_costs[c[0] ^ key];
+  if (n == 1) {
+    return cost;
+  }
+  cost += model.bigram_cost(c[0] ^ key, c[1] ^ key);
+  uint32_t key3 = key * 0x010101u;
+  uint32_t t = uint32_t(c[0]) << 8 | c[1];
+  for (size_t i = 2; i < n; i++) {
+    t = (t << 8 | c[i]) & 0xffffff;
+    cost += model.trigram_cost(t ^ key3);
+  }
+  return cost;
+}
 
-struct LetterFrequencies {
-  std::array<unsigned int, 26> freqs;
-  unsigned int num_letters;
+// Byte histogram of a ciphertext, for key pruning, along with the ciphertext
+// itself, which must outlive it, for ngram_cost
+class XorNGrams {
+public:
+  explicit XorNGrams(span<const byte> ciphertext, byte key = 0)
+      : histogram_(ciphertext, key), ciphertext_(ciphertext), key_(key) {}
+
+  size_t size() const { return histogram_.size(); }
+
+  KeySet printable_keys() const { return histogram_.printable_keys(); }
+
+  // Total cost of the plaintext under key, in model cost units
+  unsigned long cost(const NGramModel &model, byte key) const {
+    return ngram_cost(model, ciphertext_, key ^ key_);
+  }
+
+private:
+  XorHistogram histogram_;
+  span<const byte> ciphertext_;
+  byte key_;
 };
 
-LetterFrequencies count_letters(const std::vector<byte> &byte_vector) {
-  LetterFrequencies lf = {}; // default value initilization (freqs = [0, ...])
+namespace scorer {
+
+// Cost per byte of the plaintext under an n-gram model, in nats: it sees
+// the order of the bytes, which is what sets keys apart on short lines. The
+// model defaults to default_ngrams.
+template <const NGramModel &(*model)() = default_ngrams> struct NGram {
+  using Counts = XorNGrams;
 
-  for (auto b : byte_vector) {
-    if (is_lower(b)) {
-      lf.freqs[b - 'a'] += 1;
-      lf.num_letters++;
-    } else if (is_upper(b)) {
-      lf.freqs[b - 'A'] += 1;
-      lf.num_letters++;
+  static const NGramModel &ngram_model() { return model(); }
+
+  static double score(const XorNGrams &ngrams, byte key) {
+    if (ngrams.size() == 0) {
+      return 0.0;
     }
+    return ngrams.cost(model(), key) /
+           (model().cost_scale * ngrams.size());
   }
 
-  return lf;
-}
+  static double score_xored(span<const byte> ciphertext, byte key) {
+    if (ciphertext.size() == 0) {
+      return 0.0;
+    }
+    return ngram_cost(model(), ciphertext, key) /
+           (model().cost_scale * ciphertext.size());
+  }
+};
 
-double chi_squared_statistic(const std::vector<byte> &byte_vector) {
-  auto lf = count_letters(byte_vector);
+// Whether Scorer scores all keys at once with score_all
+template <typename Scorer> struct scores_all_keys : std::false_type {};
+template <> struct scores_all_keys<FixedChiSquared> : std::true_type {};
 
-  static constexpr std::array<double, 26> english_freqs{
-      {0.08167, 0.01492, 0.02782, 0.04253, 0.12702, 0.02228, 0.02015,
-       0.06094, 0.06966, 0.00153, 0.00772, 0.04025, 0.02406, 0.06749,
-       0.07507, 0.01929, 0.00095, 0.05987, 0.06327, 0.09056, 0.02758,
-       0.00978, 0.02360, 0.00150, 0.01974, 0.00074}}; // wikipedia
+// Whether Scorer scores a key straight from the ciphertext with score_xored
+template <typename Scorer> struct scores_xored : std::false_type {};
+template <> struct scores_xored<ChiSquared> : std::true_type {};
+template <const NGramModel &(*model)()>
+struct scores_xored<NGram<model>> : std::true_type {};
 
-  double chi_statistic = 0.0;
-  for (auto i = 0; i < 26; i++) {
-    auto o_i = lf.freqs[i];                       // observation
-    auto e_i = lf.num_letters * english_freqs[i]; // expected value
-    chi_statistic += ((o_i - e_i) * (o_i - e_i)) / e_i;
-  }
+template <typename Scorer> struct is_ngram : std::false_type {};
+template <const NGramModel &(*model)()>
+struct is_ngram<NGram<model>> : std::true_type {};
 
-  return chi_statistic;
-}
+} // namespace scorer
+
+// How decrypt_single_byte_xor counts the bytes of each key: with a pass
+// over the ciphertext per key, or from one histogram of the ciphertext. The
+// histogram is faster from a few bytes on, and by far for long ciphertexts.
+enum class KeySearch { per_key, histogram };
 
+// best_chis receives the Scorer scores of the best keys
 template <unsigned short int num_keys = 1, bool only_printable = true,
-          bool return_chi_stats = true>
+          bool return_chi_stats = true, typename Scorer = scorer::ChiSquared,
+          KeySearch search = KeySearch::histogram>
 std::array<byte, num_keys>
-decrypt_single_byte_xor(const std::vector<byte> &ciphertext,
+decrypt_single_byte_xor(span<const byte> ciphertext,
                         std::array<double, num_keys> &best_chis) {
   using key_score = std::pair<double, byte>; // double first to sort later
   std::array<key_score, 256> scores;
 
+  // With only_printable, the keys that leave an unprintable byte are pruned
+  // up front and never counted
   for (auto i = 0; i < 256; i++) {
-    auto plaintext = single_byte_xor(ciphertext, i);
-    if (!only_printable || is_container_printable(plaintext)) {
-      scores[i] = key_score(chi_squared_statistic(plaintext), i);
-    } else { // only printable && !is_container_printable(new_plaintext)
-      scores[i] = key_score(std::numeric_limits<double>::max(), i);
+    scores[i] = key_score(std::numeric_limits<double>::max(), i);
+  }
+  using Counts = typename Scorer::Counts;
+  if (search == KeySearch::histogram) {
+    Counts counts(ciphertext);
+    auto keys = only_printable ? counts.printable_keys() : all_keys;
+    if constexpr (scorer::scores_all_keys<Scorer>::value) {
+      std::array<double, 256> all_scores;
+      Scorer::score_all(counts, all_scores);
+      keys.for_each([&](byte key) {
+        scores[key] = key_score(all_scores[key], key);
+      });
+    } else {
+      keys.for_each([&](byte key) {
+        scores[key] = key_score(Scorer::score(counts, key), key);
+      });
+    }
+  } else {
+    auto keys = only_printable ? printable_keys(ciphertext) : all_keys;
+    if constexpr (scorer::scores_xored<Scorer>::value) {
+      keys.for_each([&](byte key) {
+        scores[key] = key_score(Scorer::score_xored(ciphertext, key), key);
+      });
+    } else {
+      keys.for_each([&](byte key) {
+        Counts plaintext(ciphertext, key);
+        scores[key] = key_score(Scorer::score(plaintext, 0), key);
+      });
     }
   }
 
@@ -306,30 +3711,31 @@ decrypt_single_byte_xor(const std::vector<byte> &ciphertext,
 }
 
 // Simple version for non-returning chi statistics
-template <unsigned short int num_keys = 1, bool only_printable = true>
+template <unsigned short int num_keys = 1, bool only_printable = true,
+          typename Scorer = scorer::ChiSquared,
+          KeySearch search = KeySearch::histogram>
 std::array<byte, num_keys>
-decrypt_single_byte_xor(const std::vector<byte> &ciphertext) {
+decrypt_single_byte_xor(span<const byte> ciphertext) {
   std::array<double, num_keys> null_array;
-  return decrypt_single_byte_xor<num_keys, only_printable, false>(ciphertext,
-                                                                  null_array);
+  return decrypt_single_byte_xor<num_keys, only_printable, false, Scorer,
+                                 search>(ciphertext, null_array);
 }
 
-template <unsigned short int num_lines = 1, bool only_printable = true>
+template <unsigned short int num_lines = 1, bool only_printable = true,
+          typename Scorer = scorer::ChiSquared>
 std::array<unsigned int, num_lines>
 detect_single_byte_xor(std::experimental::string_view filename) {
-  std::ifstream input(filename.data());
-  std::string cipherline;
-
   using line_score = std::pair<double, unsigned int>; // double first to sort
   std::vector<line_score> scores;
 
-  for (unsigned int i = 0; std::getline(input, cipherline); i++) {
+  unsigned int i = 0;
+  for_each_record(filename, Encoding::hex, [&](const auto &ciphertext) {
     std::array<double, 1> best_chis;
-    decrypt_single_byte_xor<1, only_printable, true>(
-        string_to_bytes(cipherline), best_chis);
+    decrypt_single_byte_xor<1, only_printable, true, Scorer>(ciphertext,
+                                                             best_chis);
 
-    scores.push_back(line_score(best_chis[0], i));
-  }
+    scores.push_back(line_score(best_chis[0], i++));
+  });
 
   std::partial_sort(scores.begin(), scores.begin() + num_lines, scores.end());
 
@@ -375,8 +3781,100 @@ double key_size_score(const std::vector<byte> &v, unsigned int key_size) {
   return distance;
 }
 
+// Bytes of ciphertext xored with byte i of a repeating key of key_size bytes
+std::vector<byte> key_column(const std::vector<byte> &ciphertext,
+                             size_t key_size, size_t i) {
+  std::vector<byte> column;
+  column.reserve(ciphertext.size() / key_size + 1);
+  for (size_t j = i; j < ciphertext.size(); j += key_size) {
+    column.push_back(ciphertext[j]);
+  }
+  return column;
+}
+
+// Repeating key of key_size bytes found with an n-gram model. The bytes of a
+// column are key_size apart in the plaintext, so each column only gives its
+// best few candidates, by log-likelihood. The key is the chain of candidates
+// with the least bigram cost between neighboring columns, wrapping from the
+// last column to the first one of the next row, found by dynamic
+// programming for each candidate of the first column.
+template <bool only_printable = true, unsigned short int num_candidates = 4>
+std::vector<byte> solve_key_columns(const std::vector<byte> &ciphertext,
+                                    size_t key_size, const NGramModel &model) {
+  std::vector<std::array<byte, num_candidates>> candidates(key_size);
+  std::vector<size_t> num_kept(key_size);
+  for (size_t i = 0; i < key_size; i++) {
+    std::array<double, num_candidates> scores;
+    candidates[i] = decrypt_single_byte_xor<num_candidates, only_printable,
+                                            true, scorer::LogLikelihood>(
+        key_column(ciphertext, key_size, i), scores);
+    // keys pruned as unprintable have the maximum score, keep at least one
+    num_kept[i] = std::max<size_t>(
+        1, std::count_if(scores.begin(), scores.end(), [](double score) {
+          return score != std::numeric_limits<double>::max();
+        }));
+  }
+
+  // Bigram cost between candidate a of column i and candidate b of the next
+  // column, or of the first column of the next row for the last column
+  auto link_cost = [&](size_t i, byte a, byte b) {
+    unsigned long cost = 0;
+    for (size_t j = i; j + 1 < ciphertext.size(); j += key_size) {
+      cost += model.bigram_cost(ciphertext[j] ^ a, ciphertext[j + 1] ^ b);
+    }
+    return cost;
+  };
+
+  std::vector<byte> best_key;
+  auto best_cost = std::numeric_limits<unsigned long>::max();
+  for (size_t first = 0; first < num_kept[0]; first++) {
+    // cost of the best chain ending at each candidate of column i, and the
+    // candidate of column i - 1 it comes from
+    std::vector<std::array<unsigned long, num_candidates>> costs(key_size);
+    std::vector<std::array<size_t, num_candidates>> from(key_size);
+    costs[0].fill(std::numeric_limits<unsigned long>::max());
+    costs[0][first] = 0;
+    for (size_t i = 1; i < key_size; i++) {
+      for (size_t b = 0; b < num_kept[i]; b++) {
+        costs[i][b] = std::numeric_limits<unsigned long>::max();
+        for (size_t a = 0; a < num_kept[i - 1]; a++) {
+          if (costs[i - 1][a] == std::numeric_limits<unsigned long>::max()) {
+            continue;
+          }
+          auto cost = costs[i - 1][a] +
+                      link_cost(i - 1, candidates[i - 1][a], candidates[i][b]);
+          if (cost < costs[i][b]) {
+            costs[i][b] = cost;
+            from[i][b] = a;
+          }
+        }
+      }
+    }
+
+    auto last = key_size - 1;
+    for (size_t b = 0; b < num_kept[last]; b++) {
+      if (costs[last][b] == std::numeric_limits<unsigned long>::max()) {
+        continue;
+      }
+      auto cost = costs[last][b] +
+                  link_cost(last, candidates[last][b], candidates[0][first]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_key.assign(key_size, 0);
+        for (size_t i = last, c = b; i > 0; c = from[i][c], i--) {
+          best_key[i] = candidates[i][c];
+        }
+        best_key[0] = candidates[0][first];
+      }
+    }
+  }
+
+  return best_key;
+}
+
 template <unsigned int max_key_size = 40, bool only_printable = true,
-          unsigned int num_keysize_blocks = 10>
+          unsigned int num_keysize_blocks = 10,
+          typename Scorer = scorer::ChiSquared>
 std::vector<byte>
 break_repeating_key_xor(std::experimental::string_view filename) {
   auto bytes = file_to_bytes(filename, Encoding::base64);
@@ -393,15 +3891,16 @@ break_repeating_key_xor(std::experimental::string_view filename) {
     }
   }
 
+  if constexpr (scorer::is_ngram<Scorer>::value) {
+    return solve_key_columns<only_printable>(bytes, best_key_size,
+                                             Scorer::ngram_model());
+  }
+
   std::vector<byte> key;
   key.reserve(best_key_size);
   for (size_t i = 0; i < best_key_size; i++) {
-    std::vector<byte> block;
-    block.reserve(bytes.size() / best_key_size);
-    for (size_t j = i; j < bytes.size(); j += best_key_size) {
-      block.push_back(bytes[j]);
-    }
-    key.push_back(decrypt_single_byte_xor<1, only_printable>(block)[0]);
+    key.push_back(decrypt_single_byte_xor<1, only_printable, Scorer>(
+        key_column(bytes, best_key_size, i))[0]);
   }
 
   return key;
@@ -428,7 +3927,7 @@ std::vector<byte> decrypt_aes_128_ecb(const std::vector<byte> &ciphertext,
   return std::vector<byte>(std::begin(ss), std::end(ss));
 }
 
-unsigned int aes_128_ecb_score(const std::vector<byte> &ciphertext) {
+unsigned int aes_128_ecb_score(span<const byte> ciphertext) {
   static constexpr auto block_size = 16;
   assert(ciphertext.size() % block_size == 0);
 
@@ -448,17 +3947,14 @@ unsigned int aes_128_ecb_score(const std::vector<byte> &ciphertext) {
 template <unsigned short int num_lines = 1>
 std::array<unsigned int, num_lines>
 detect_aes_128_ecb(std::experimental::string_view filename) {
-  std::ifstream input(filename.data());
-  std::string cipherline;
-
   // TODO: change to a struct
   using line_score = std::pair<unsigned int, unsigned int>; // first score
   std::vector<line_score> scores;
 
-  for (unsigned int i = 0; std::getline(input, cipherline); i++) {
-    scores.push_back(
-        line_score(aes_128_ecb_score(string_to_bytes(cipherline)), i));
-  }
+  unsigned int i = 0;
+  for_each_record(filename, Encoding::hex, [&](const auto &ciphertext) {
+    scores.push_back(line_score(aes_128_ecb_score(ciphertext), i++));
+  });
 
   std::partial_sort(scores.begin(), scores.begin() + num_lines, scores.end(),
                     std::greater<>());